@@ -2,6 +2,7 @@
 //#define LOG_NDEBUG 0
 #include <android-base/logging.h>
 #include <utils/Log.h>
+#include <inttypes.h>
 #include <grallocusage/GrallocUsageConversion.h>
 
 #include <hardware/gralloc1.h>
@@ -35,9 +36,12 @@ Allocator::~Allocator() {
 }
 
 Return<void> Allocator::dumpDebugInfo(dumpDebugInfo_cb hidl_cb) {
-    std::vector<char> buf(1);
-    buf[0] = '\0';
-	hidl_cb(buf.data());
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "-- allocator-rpi3 --\n"
+             "allocate calls: %" PRIu64 ", buffers: %" PRIu64 ", failures: %" PRIu64 "\n",
+             mAllocateCalls.load(), mBuffersAllocated.load(), mFailures.load());
+	hidl_cb(buf);
     return Void();
 }
 
@@ -108,13 +112,16 @@ Error Allocator::allocateOneBuffer(
     }
     *outBufferHandle = handle;
     *outStride = stride;
+    mBuffersAllocated++;
     return Error::NONE;
 }
 
 Return<void> Allocator::allocate(const BufferDescriptor& descriptor,
         uint32_t count, IAllocator::allocate_cb hidl_cb) {
     IMapper::BufferDescriptorInfo descInfo;
+    mAllocateCalls++;
     if (!grallocDecodeBufferDescriptor(descriptor, &descInfo)) {
+        mFailures++;
         hidl_cb(Error::BAD_DESCRIPTOR, 0, hidl_vec<hidl_handle>());
         return Void();
     }
@@ -142,6 +149,7 @@ Return<void> Allocator::allocate(const BufferDescriptor& descriptor,
     }
 
     if (error != Error::NONE) {
+        mFailures++;
         freeBuffers(buffers);
         hidl_cb(error, 0, hidl_vec<hidl_handle>());
         return Void();
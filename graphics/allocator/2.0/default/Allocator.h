@@ -5,6 +5,8 @@
 #include <android/hardware/graphics/mapper/2.0/IMapper.h>
 #include <mapper-passthrough/2.0/GrallocBufferDescriptor.h>
 
+#include <atomic>
+
 namespace android {
 namespace hardware {
 namespace graphics {
@@ -31,6 +33,11 @@ class Allocator : public IAllocator {
     void freeBuffers(const std::vector<const native_handle_t*>& buffers);
 
     struct drm_module_t* mModule;
+
+    // reported by dumpDebugInfo()
+    std::atomic<uint64_t> mAllocateCalls{0};
+    std::atomic<uint64_t> mBuffersAllocated{0};
+    std::atomic<uint64_t> mFailures{0};
 };
 
 }  // namespace implementation
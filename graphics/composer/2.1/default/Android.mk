@@ -9,6 +9,13 @@ LOCAL_MODULE_TAGS := optional
 
 LOCAL_SRC_FILES := \
         drm_kms_rpi3.cpp \
+        drm_atomic_rpi3.cpp \
+        drm_fb_rpi3.cpp \
+        drm_hotplug_rpi3.cpp \
+        drm_color_rpi3.cpp \
+        PlaneAssigner.cpp \
+        FrameTimeline.cpp \
+        sw_timeline.cpp \
         Hwc2Device.cpp \
         ComposerHal.cpp \
         ComposerCommandEngine.cpp \
@@ -26,6 +33,7 @@ LOCAL_SHARED_LIBRARIES := \
         libcutils \
         liblog \
         libhardware \
+        libhardware_legacy \
         libfmq \
         libEGL \
         libui \
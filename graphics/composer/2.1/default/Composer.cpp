@@ -18,7 +18,9 @@ Composer::Composer() {
 
 Return<void> Composer::getCapabilities(getCapabilities_cb hidl_cb) {
     std::vector<Capability> caps;
-    caps.push_back(Capability::PRESENT_FENCE_IS_NOT_RELIABLE);
+    for (auto cap : mHal->getCapabilities()) {
+        caps.push_back(static_cast<Capability>(cap));
+    }
 
     hidl_vec<Capability> caps_reply;
     caps_reply.setToExternal(caps.data(), caps.size());
@@ -1,7 +1,9 @@
 #define LOG_TAG "composer@2.0-ComposerClient"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 //#define LOG_NDEBUG 0
 #include <android-base/logging.h>
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
 #include "ComposerClient.h"
 
@@ -125,7 +127,7 @@ Return<Error> ComposerClient::destroyLayer(Display display, Layer layer) {
 Return<void> ComposerClient::getActiveConfig(Display display,
                              IComposerClient::getActiveConfig_cb hidl_cb) {
     Config config = 0;
-    Error err = (0 == display) ? Error::NONE : Error::BAD_DISPLAY;
+    Error err = mHal->getActiveConfig(display, &config);
     hidl_cb(err, config);
     return Void();
 }
@@ -139,12 +141,7 @@ Return<Error> ComposerClient::getClientTargetSupport(Display display, uint32_t w
 Return<void> ComposerClient::getColorModes(Display display,
                            IComposerClient::getColorModes_cb hidl_cb) {
     hidl_vec<ColorMode> modes;
-    Error err = Error::BAD_DISPLAY;
-    if (0 == display) {
-        modes.resize(1);
-        modes.data()[0]=ColorMode::NATIVE;
-        err = Error::NONE;
-    }
+    Error err = mHal->getColorModes(display, &modes);
     hidl_cb(err, modes);
     return Void();
 }
@@ -161,12 +158,7 @@ Return<void> ComposerClient::getDisplayAttribute(Display display, Config config,
 Return<void> ComposerClient::getDisplayConfigs(Display display,
                                IComposerClient::getDisplayConfigs_cb hidl_cb) {
     hidl_vec<Config> configs;
-    Error err = Error::BAD_DISPLAY;
-    if (0 == display) {
-        configs.resize(1);
-        configs.data()[0]=0;
-        err = Error::NONE;
-    }
+    Error err = mHal->getDisplayConfigs(display, &configs);
     hidl_cb(err, configs);
     return Void();
 }
@@ -182,18 +174,16 @@ Return<void> ComposerClient::getDisplayName(Display display,
 Return<void> ComposerClient::getDisplayType(Display display,
                             IComposerClient::getDisplayType_cb hidl_cb) {
     DisplayType type = DisplayType::INVALID;
-    Error err = Error::BAD_DISPLAY;
-    if (0 == display) {
-        type = DisplayType::PHYSICAL;
-        err = Error::NONE;
-    }
+    Error err = mHal->getDisplayType(display, &type);
     hidl_cb(err, type);
     return Void();
 }
 
-Return<void> ComposerClient::getDozeSupport(Display /*display*/,
+Return<void> ComposerClient::getDozeSupport(Display display,
                             IComposerClient::getDozeSupport_cb hidl_cb) {
-    hidl_cb(Error::NONE, false);
+    bool support = false;
+    Error err = mHal->getDozeSupport(display, &support);
+    hidl_cb(err, support);
     return Void();
 }
 
@@ -210,19 +200,18 @@ Return<Error> ComposerClient::setClientTargetSlotCount(Display display,
 }
 
 Return<Error> ComposerClient::setActiveConfig(Display display, Config config) {
-    if (0 != display) return Error::BAD_DISPLAY;
-    if (0 != config) return Error::BAD_CONFIG;
-    return Error::NONE;
+    Error err = mHal->setActiveConfig(display, config);
+    return err;
 }
 
 Return<Error> ComposerClient::setColorMode(Display display, ColorMode mode) {
-    if (0 != display) return Error::BAD_DISPLAY;
-    if (ColorMode::NATIVE != mode) return Error::BAD_PARAMETER;
-    return Error::NONE;
+    Error err = mHal->setColorMode(display, mode);
+    return err;
 }
 
-Return<Error> ComposerClient::setPowerMode(Display /*display*/, IComposerClient::PowerMode /*mode*/) {
-    return Error::NONE;
+Return<Error> ComposerClient::setPowerMode(Display display, IComposerClient::PowerMode mode) {
+    Error err = mHal->setPowerMode(display, mode);
+    return err;
 }
 
 Return<Error> ComposerClient::setVsyncEnabled(Display display, IComposerClient::Vsync enabled) {
@@ -247,6 +236,7 @@ Return<void> ComposerClient::getOutputCommandQueue(IComposerClient::getOutputCom
 
 Return<void> ComposerClient::executeCommands(uint32_t inLength, const hidl_vec<hidl_handle>& inHandles,
                              IComposerClient::executeCommands_cb hidl_cb) {
+    ATRACE_CALL();
     std::lock_guard<std::mutex> lock(mCommandEngineMutex);
     bool outChanged = false;
     uint32_t outLength = 0;
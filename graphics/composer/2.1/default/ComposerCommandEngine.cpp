@@ -1,7 +1,9 @@
 #define LOG_TAG "composer@2.1-CommandEngine"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 //#define LOG_NDEBUG 0
 #include <android-base/logging.h>
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
 #include "ComposerCommandEngine.h"
 
@@ -28,9 +30,11 @@ void ComposerCommandEngine::reset() {
 
 Error ComposerCommandEngine::execute(uint32_t inLength, const hidl_vec<hidl_handle>& inHandles, bool* outQueueChanged,
               uint32_t* outCommandLength, hidl_vec<hidl_handle>* outCommandHandles) {
+    mHal->beginCommandBatch();
     if (!readQueue(inLength, inHandles)) {
         return Error::BAD_PARAMETER;
     }
+    size_t capacity = scratchCapacity();
     IComposerClient::Command command;
     uint16_t length = 0;
     while (!isEmpty()) {
@@ -45,6 +49,7 @@ Error ComposerCommandEngine::execute(uint32_t inLength, const hidl_vec<hidl_hand
             break;
         }
     }
+    mHal->recordCommandBatch(scratchCapacity() != capacity);
     if (!isEmpty()) {
         return Error::BAD_PARAMETER;
     }
@@ -53,6 +58,12 @@ Error ComposerCommandEngine::execute(uint32_t inLength, const hidl_vec<hidl_hand
                : Error::NO_RESOURCES;
 }
 
+size_t ComposerCommandEngine::scratchCapacity() const {
+    return mRegion.capacity() + mChangedLayers.capacity() + mCompositionTypes.capacity() +
+           mRequestedLayers.capacity() + mRequestMasks.capacity() + mReleasedLayers.capacity() +
+           mReleaseFences.capacity();
+}
+
 bool ComposerCommandEngine::executeCommand(IComposerClient::Command command, uint16_t length) {
      switch (command) {
          case IComposerClient::Command::SELECT_DISPLAY:
@@ -127,15 +138,21 @@ bool ComposerCommandEngine::executeSetColorTransform(uint16_t length) {
     if (length != CommandWriterBase::kSetColorTransformLength) {
         return false;
     }
+    float matrix[16];
     for (int i = 0; i < 16; i++) {
-        readFloat();
+        matrix[i] = readFloat();
+    }
+    auto hint = readSigned();
+    auto err = mHal->setColorTransform(mCurrentDisplay, matrix, hint);
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
     }
-    readSigned();
     return true;
 }
 
 
 bool ComposerCommandEngine::executeSetClientTarget(uint16_t length) {
+    ATRACE_CALL();
     // 4 parameters followed by N rectangles
     if ((length - 4) % 4 != 0) {
         return false;
@@ -146,18 +163,21 @@ bool ComposerCommandEngine::executeSetClientTarget(uint16_t length) {
     auto rawHandle = readHandle(&useCache);
     auto fence = readFence();
     auto dataspace = readSigned();
-    auto damage = readRegion((length - 4) / 4);
+    const auto& damage = readRegion((length - 4) / 4);
     bool closeFence = true;
 
     const native_handle_t* clientTarget;
     ComposerResources::ReplacedBufferHandle replacedClientTarget;
     auto err = mResources->getDisplayClientTarget(mCurrentDisplay, slot, useCache, rawHandle,
                                                   &clientTarget, &replacedClientTarget);
+    if (err == Error::NONE && !useCache && clientTarget) {
+        // the slot got a new buffer, failing here only delays the fb
+        mHal->prepareClientTarget(mCurrentDisplay, clientTarget);
+    }
     if (err == Error::NONE) {
+        // the device owns the fence from here on, failed or not
         err = mHal->setClientTarget(mCurrentDisplay, clientTarget, fence, dataspace, damage);
-        if (err == Error::NONE) {
-            closeFence = false;
-        }
+        closeFence = false;
     }
     if (closeFence) {
         close(fence);
@@ -190,21 +210,17 @@ bool ComposerCommandEngine::executeSetOutputBuffer(uint16_t length) {
 }
 
 bool ComposerCommandEngine::executeValidateDisplay(uint16_t length) {
+    ATRACE_CALL();
     if (length != CommandWriterBase::kValidateDisplayLength) {
         return false;
     }
 
-    std::vector<Layer> changedLayers;
-    std::vector<IComposerClient::Composition> compositionTypes;
     uint32_t displayRequestMask = 0x0;
-    std::vector<Layer> requestedLayers;
-    std::vector<uint32_t> requestMasks;
-
-    auto err = mHal->validateDisplay(mCurrentDisplay, &changedLayers, &compositionTypes,
-                                     &displayRequestMask, &requestedLayers, &requestMasks);
+    auto err = mHal->validateDisplay(mCurrentDisplay, &mChangedLayers, &mCompositionTypes,
+                                     &displayRequestMask, &mRequestedLayers, &mRequestMasks);
     if (err == Error::NONE) {
-        mWriter.setChangedCompositionTypes(changedLayers, compositionTypes);
-        mWriter.setDisplayRequests(displayRequestMask, requestedLayers, requestMasks);
+        mWriter.setChangedCompositionTypes(mChangedLayers, mCompositionTypes);
+        mWriter.setDisplayRequests(displayRequestMask, mRequestedLayers, mRequestMasks);
     } else {
         mWriter.setError(getCommandLoc(), err);
     }
@@ -213,23 +229,33 @@ bool ComposerCommandEngine::executeValidateDisplay(uint16_t length) {
 }
 
 bool ComposerCommandEngine::executePresentOrValidateDisplay(uint16_t length) {
+    ATRACE_CALL();
     if (length != CommandWriterBase::kPresentOrValidateDisplayLength) {
         return false;
     }
 
+    // First try to present as is, the device refuses when the frame needs
+    // to be validated again
+    if (mHal->hasCapability(HWC2_CAPABILITY_SKIP_VALIDATE)) {
+        int presentFence = -1;
+        auto err = mHal->presentDisplay(mCurrentDisplay, &presentFence, &mReleasedLayers,
+                                        &mReleaseFences);
+        if (err == Error::NONE) {
+            mWriter.setPresentOrValidateResult(1);
+            mWriter.setPresentFence(presentFence);
+            mWriter.setReleaseFences(mReleasedLayers, mReleaseFences);
+            return true;
+        }
+    }
+
     // Present has failed. We need to fallback to validate
-    std::vector<Layer> changedLayers;
-    std::vector<IComposerClient::Composition> compositionTypes;
     uint32_t displayRequestMask = 0x0;
-    std::vector<Layer> requestedLayers;
-    std::vector<uint32_t> requestMasks;
-
-    auto err = mHal->validateDisplay(mCurrentDisplay, &changedLayers, &compositionTypes,
-                                     &displayRequestMask, &requestedLayers, &requestMasks);
+    auto err = mHal->validateDisplay(mCurrentDisplay, &mChangedLayers, &mCompositionTypes,
+                                     &displayRequestMask, &mRequestedLayers, &mRequestMasks);
     if (err == Error::NONE) {
         mWriter.setPresentOrValidateResult(0);
-        mWriter.setChangedCompositionTypes(changedLayers, compositionTypes);
-        mWriter.setDisplayRequests(displayRequestMask, requestedLayers, requestMasks);
+        mWriter.setChangedCompositionTypes(mChangedLayers, mCompositionTypes);
+        mWriter.setDisplayRequests(displayRequestMask, mRequestedLayers, mRequestMasks);
     } else {
         mWriter.setError(getCommandLoc(), err);
     }
@@ -251,17 +277,17 @@ bool ComposerCommandEngine::executeAcceptDisplayChanges(uint16_t length) {
 }
 
 bool ComposerCommandEngine::executePresentDisplay(uint16_t length) {
+    ATRACE_CALL();
     if (length != CommandWriterBase::kPresentDisplayLength) {
         return false;
     }
 
     int presentFence = -1;
-    std::vector<Layer> layers;
-    std::vector<int> fences;
-    auto err = mHal->presentDisplay(mCurrentDisplay, &presentFence, &layers, &fences);
+    auto err = mHal->presentDisplay(mCurrentDisplay, &presentFence, &mReleasedLayers,
+                                    &mReleaseFences);
     if (err == Error::NONE) {
         mWriter.setPresentFence(presentFence);
-        mWriter.setReleaseFences(layers, fences);
+        mWriter.setReleaseFences(mReleasedLayers, mReleaseFences);
     } else {
         mWriter.setError(getCommandLoc(), err);
     }
@@ -273,9 +299,9 @@ bool ComposerCommandEngine::executeSetLayerCursorPosition(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerCursorPositionLength) {
         return false;
     }
-    readSigned();
-    readSigned();
-    auto err = Error::BAD_DISPLAY;
+    auto x = readSigned();
+    auto y = readSigned();
+    auto err = mHal->setLayerCursorPosition(mCurrentDisplay, mCurrentLayer, x, y);
     if (err != Error::NONE) {
         mWriter.setError(getCommandLoc(), err);
     }
@@ -283,19 +309,31 @@ bool ComposerCommandEngine::executeSetLayerCursorPosition(uint16_t length) {
 }
 
 bool ComposerCommandEngine::executeSetLayerBuffer(uint16_t length) {
+    ATRACE_CALL();
     if (length != CommandWriterBase::kSetLayerBufferLength) {
         return false;
     }
 
     bool useCache = false;
-    read();
-    readHandle(&useCache);
+    auto slot = read();
+    auto rawHandle = readHandle(&useCache);
     auto fence = readFence();
+    bool closeFence = true;
 
-    if (fence >= 0) {
-        sync_wait(fence, -1);
+    const native_handle_t* buffer;
+    ComposerResources::ReplacedBufferHandle replacedBuffer;
+    auto err = mResources->getLayerBuffer(mCurrentDisplay, mCurrentLayer, slot, useCache,
+                                          rawHandle, &buffer, &replacedBuffer);
+    if (err == Error::NONE) {
+        err = mHal->setLayerBuffer(mCurrentDisplay, mCurrentLayer, buffer, fence);
+        closeFence = false;
+    }
+    if (closeFence) {
         close(fence);
     }
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -304,7 +342,11 @@ bool ComposerCommandEngine::executeSetLayerSurfaceDamage(uint16_t length) {
     if (length % 4 != 0) {
         return false;
     }
-    readRegion(length / 4);
+    const auto& damage = readRegion(length / 4);
+    auto err = mHal->setLayerSurfaceDamage(mCurrentDisplay, mCurrentLayer, damage);
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -312,7 +354,10 @@ bool ComposerCommandEngine::executeSetLayerBlendMode(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerBlendModeLength) {
         return false;
     }
-    readSigned();
+    auto err = mHal->setLayerBlendMode(mCurrentDisplay, mCurrentLayer, readSigned());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -320,7 +365,10 @@ bool ComposerCommandEngine::executeSetLayerColor(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerColorLength) {
         return false;
     }
-    readColor();
+    auto err = mHal->setLayerColor(mCurrentDisplay, mCurrentLayer, readColor());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -341,7 +389,10 @@ bool ComposerCommandEngine::executeSetLayerDataspace(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerDataspaceLength) {
         return false;
     }
-    readSigned();
+    auto err = mHal->setLayerDataspace(mCurrentDisplay, mCurrentLayer, readSigned());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -350,7 +401,10 @@ bool ComposerCommandEngine::executeSetLayerDisplayFrame(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerDisplayFrameLength) {
         return false;
     }
-    readRect();
+    auto err = mHal->setLayerDisplayFrame(mCurrentDisplay, mCurrentLayer, readRect());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -358,7 +412,10 @@ bool ComposerCommandEngine::executeSetLayerPlaneAlpha(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerPlaneAlphaLength) {
         return false;
     }
-    readFloat();
+    auto err = mHal->setLayerPlaneAlpha(mCurrentDisplay, mCurrentLayer, readFloat());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -374,7 +431,10 @@ bool ComposerCommandEngine::executeSetLayerSourceCrop(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerSourceCropLength) {
         return false;
     }
-    readFRect();
+    auto err = mHal->setLayerSourceCrop(mCurrentDisplay, mCurrentLayer, readFRect());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -382,7 +442,10 @@ bool ComposerCommandEngine::executeSetLayerTransform(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerTransformLength) {
         return false;
     }
-    readSigned();
+    auto err = mHal->setLayerTransform(mCurrentDisplay, mCurrentLayer, readSigned());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -391,7 +454,11 @@ bool ComposerCommandEngine::executeSetLayerVisibleRegion(uint16_t length) {
     if (length % 4 != 0) {
         return false;
     }
-    readRegion(length / 4);
+    const auto& visible = readRegion(length / 4);
+    auto err = mHal->setLayerVisibleRegion(mCurrentDisplay, mCurrentLayer, visible);
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
@@ -399,7 +466,10 @@ bool ComposerCommandEngine::executeSetLayerZOrder(uint16_t length) {
     if (length != CommandWriterBase::kSetLayerZOrderLength) {
         return false;
     }
-    read();
+    auto err = mHal->setLayerZOrder(mCurrentDisplay, mCurrentLayer, read());
+    if (err != Error::NONE) {
+        mWriter.setError(getCommandLoc(), err);
+    }
     return true;
 }
 
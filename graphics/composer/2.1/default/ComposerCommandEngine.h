@@ -67,6 +67,16 @@ class ComposerCommandEngine : protected CommandReaderBase {
     Display mCurrentDisplay = 0;
     Layer mCurrentLayer = 0;
 
+    // Scratch buffers reused by every batch, a steady stream of frames
+    // parses without heap allocations once they have grown to fit
+    std::vector<hwc_rect_t> mRegion;
+    std::vector<Layer> mChangedLayers;
+    std::vector<IComposerClient::Composition> mCompositionTypes;
+    std::vector<Layer> mRequestedLayers;
+    std::vector<uint32_t> mRequestMasks;
+    std::vector<Layer> mReleasedLayers;
+    std::vector<int> mReleaseFences;
+    size_t scratchCapacity() const;
 
     hwc_rect_t readRect() {
         return hwc_rect_t{
@@ -74,15 +84,15 @@ class ComposerCommandEngine : protected CommandReaderBase {
         };
     }
 
-    std::vector<hwc_rect_t> readRegion(size_t count) {
-        std::vector<hwc_rect_t> region;
-        region.reserve(count);
+    // valid until the next command reads a region
+    const std::vector<hwc_rect_t>& readRegion(size_t count) {
+        mRegion.clear();
         while (count > 0) {
-            region.emplace_back(readRect());
+            mRegion.emplace_back(readRect());
             count--;
         }
 
-        return region;
+        return mRegion;
     }
 
     hwc_frect_t readFRect() {
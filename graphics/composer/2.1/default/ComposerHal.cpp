@@ -14,6 +14,25 @@ namespace implementation {
 
 ComposerHal::ComposerHal() {
     mDevice = std::make_unique<Hwc2Device>();
+
+    uint32_t count = 0;
+    mDevice->getCapabilities(&count, nullptr);
+    std::vector<int32_t> caps(count);
+    mDevice->getCapabilities(&count, caps.data());
+    caps.resize(count);
+
+    mCapabilities.reserve(count);
+    for (auto cap : caps) {
+        mCapabilities.insert(static_cast<hwc2_capability_t>(cap));
+    }
+}
+
+std::vector<hwc2_capability_t> ComposerHal::getCapabilities() {
+    return std::vector<hwc2_capability_t>(mCapabilities.cbegin(), mCapabilities.cend());
+}
+
+bool ComposerHal::hasCapability(hwc2_capability_t capability) const {
+    return mCapabilities.count(capability) > 0;
 }
 
 std::string ComposerHal::dumpDebugInfo() {
@@ -25,7 +44,18 @@ std::string ComposerHal::dumpDebugInfo() {
     buf.resize(len + 1);
     buf[len] = '\0';
 
-    return buf.data();
+    std::string output = buf.data();
+    output += "Command batches: " + std::to_string(mCommandBatches.load()) +
+              ", grew command scratch buffers: " + std::to_string(mCommandBatchAllocs.load()) +
+              "\n";
+    return output;
+}
+
+void ComposerHal::recordCommandBatch(bool allocated) {
+    mCommandBatches++;
+    if (allocated) {
+        mCommandBatchAllocs++;
+    }
 }
 
 void ComposerHal::registerEventCallback(ComposerHal::EventCallback* callback) {
@@ -90,6 +120,82 @@ Error ComposerHal::getDisplayName(Display display, hidl_string* outName) {
     return Error::NONE;
 }
 
+Error ComposerHal::getDisplayType(Display display, IComposerClient::DisplayType* outType) {
+    int32_t type = HWC2_DISPLAY_TYPE_INVALID;
+    int32_t err = mDevice->getDisplayType(display, &type);
+    *outType = static_cast<IComposerClient::DisplayType>(type);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::getDozeSupport(Display display, bool* outSupport) {
+    int32_t support = 0;
+    int32_t err = mDevice->getDozeSupport(display, &support);
+    *outSupport = support != 0;
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::getDisplayConfigs(Display display, hidl_vec<Config>* outConfigs) {
+    uint32_t count = 0;
+    int32_t err = mDevice->getDisplayConfigs(display, &count, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return static_cast<Error>(err);
+    }
+
+    outConfigs->resize(count);
+    err = mDevice->getDisplayConfigs(display, &count, outConfigs->data());
+    if (err != HWC2_ERROR_NONE) {
+        outConfigs->resize(0);
+        return static_cast<Error>(err);
+    }
+    outConfigs->resize(count);
+
+    return Error::NONE;
+}
+
+Error ComposerHal::getActiveConfig(Display display, Config* outConfig) {
+    int32_t err = mDevice->getActiveConfig(display, outConfig);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setActiveConfig(Display display, Config config) {
+    int32_t err = mDevice->setActiveConfig(display, config);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::getColorModes(Display display, hidl_vec<ColorMode>* outModes) {
+    uint32_t count = 0;
+    int32_t err = mDevice->getColorModes(display, &count, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return static_cast<Error>(err);
+    }
+
+    outModes->resize(count);
+    err = mDevice->getColorModes(display, &count,
+            reinterpret_cast<std::underlying_type<ColorMode>::type*>(outModes->data()));
+    if (err != HWC2_ERROR_NONE) {
+        outModes->resize(0);
+        return static_cast<Error>(err);
+    }
+    outModes->resize(count);
+
+    return Error::NONE;
+}
+
+Error ComposerHal::setColorMode(Display display, ColorMode mode) {
+    int32_t err = mDevice->setColorMode(display, static_cast<int32_t>(mode));
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setColorTransform(Display display, const float* matrix, int32_t hint) {
+    int32_t err = mDevice->setColorTransform(display, matrix, hint);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setPowerMode(Display display, IComposerClient::PowerMode mode) {
+    int32_t err = mDevice->setPowerMode(display, static_cast<int32_t>(mode));
+    return static_cast<Error>(err);
+}
+
 Error ComposerHal::setVsyncEnabled(Display display, IComposerClient::Vsync enabled) {
     int32_t err = mDevice->setVsyncEnabled(display, static_cast<int32_t>(enabled));
     return static_cast<Error>(err);
@@ -103,6 +209,11 @@ Error ComposerHal::setClientTarget(Display display, buffer_handle_t target, int3
     return static_cast<Error>(err);
 }
 
+Error ComposerHal::prepareClientTarget(Display display, buffer_handle_t target) {
+    int32_t err = mDevice->prepareClientTarget(display, target);
+    return static_cast<Error>(err);
+}
+
 Error ComposerHal::validateDisplay(Display display, std::vector<Layer>* outChangedLayers,
                       std::vector<IComposerClient::Composition>* outCompositionTypes,
                       uint32_t* outDisplayRequestMask, std::vector<Layer>* outRequestedLayers,
@@ -121,24 +232,21 @@ Error ComposerHal::validateDisplay(Display display, std::vector<Layer>* outChang
         return static_cast<Error>(err);
     }
 
-    std::vector<Layer> changedLayers(typesCount);
-    std::vector<IComposerClient::Composition> compositionTypes(typesCount);
-    err = mDevice->getChangedCompositionTypes(display, &typesCount, changedLayers.data(),
+    // filled in place, callers may pass vectors they reuse across frames
+    outChangedLayers->resize(typesCount);
+    outCompositionTypes->resize(typesCount);
+    err = mDevice->getChangedCompositionTypes(display, &typesCount, outChangedLayers->data(),
         reinterpret_cast<std::underlying_type<IComposerClient::Composition>::type*>(
-            compositionTypes.data()));
+            outCompositionTypes->data()));
     if (err != HWC2_ERROR_NONE) {
         return static_cast<Error>(err);
     }
+    outChangedLayers->resize(typesCount);
+    outCompositionTypes->resize(typesCount);
 
-    int32_t displayReqs = 0;
-    std::vector<Layer> requestedLayers(0);
-    std::vector<uint32_t> requestMasks(0);
-
-    *outChangedLayers = std::move(changedLayers);
-    *outCompositionTypes = std::move(compositionTypes);
-    *outDisplayRequestMask = displayReqs;
-    *outRequestedLayers = std::move(requestedLayers);
-    *outRequestMasks = std::move(requestMasks);
+    *outDisplayRequestMask = 0;
+    outRequestedLayers->clear();
+    outRequestMasks->clear();
 
     return static_cast<Error>(err);
 }
@@ -155,8 +263,26 @@ Error ComposerHal::presentDisplay(Display display, int32_t* outPresentFence,
         return static_cast<Error>(err);
     }
 
-    outLayers->resize(0);
-    outReleaseFences->resize(0);
+    uint32_t count = 0;
+    err = mDevice->getReleaseFences(display, &count, nullptr, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        ALOGW("failed to get release fences");
+        return Error::NONE;
+    }
+
+    outLayers->resize(count);
+    outReleaseFences->resize(count);
+    err = mDevice->getReleaseFences(display, &count, outLayers->data(),
+                                    outReleaseFences->data());
+    if (err != HWC2_ERROR_NONE) {
+        ALOGW("failed to get release fences");
+        outLayers->clear();
+        outReleaseFences->clear();
+        return Error::NONE;
+    }
+    outLayers->resize(count);
+    outReleaseFences->resize(count);
+
     return Error::NONE;
 }
 
@@ -170,6 +296,72 @@ Error ComposerHal::setLayerCompositionType(Display display, Layer layer, int32_t
     return static_cast<Error>(err);
 }
 
+Error ComposerHal::setLayerBuffer(Display display, Layer layer, buffer_handle_t buffer,
+                                  int32_t acquireFence) {
+    int32_t err = mDevice->setLayerBuffer(display, layer, buffer, acquireFence);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerDisplayFrame(Display display, Layer layer, const hwc_rect_t& frame) {
+    int32_t err = mDevice->setLayerDisplayFrame(display, layer, frame);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerSourceCrop(Display display, Layer layer, const hwc_frect_t& crop) {
+    int32_t err = mDevice->setLayerSourceCrop(display, layer, crop);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerCursorPosition(Display display, Layer layer, int32_t x, int32_t y) {
+    int32_t err = mDevice->setCursorPosition(display, layer, x, y);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerTransform(Display display, Layer layer, int32_t transform) {
+    int32_t err = mDevice->setLayerTransform(display, layer, transform);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerZOrder(Display display, Layer layer, uint32_t z) {
+    int32_t err = mDevice->setLayerZOrder(display, layer, z);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerBlendMode(Display display, Layer layer, int32_t mode) {
+    int32_t err = mDevice->setLayerBlendMode(display, layer, mode);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerPlaneAlpha(Display display, Layer layer, float alpha) {
+    int32_t err = mDevice->setLayerPlaneAlpha(display, layer, alpha);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerDataspace(Display display, Layer layer, int32_t dataspace) {
+    int32_t err = mDevice->setLayerDataspace(display, layer, dataspace);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerVisibleRegion(Display display, Layer layer,
+                                         const std::vector<hwc_rect_t>& visible) {
+    hwc_region region = {visible.size(), visible.data()};
+    int32_t err = mDevice->setLayerVisibleRegion(display, layer, region);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerSurfaceDamage(Display display, Layer layer,
+                                         const std::vector<hwc_rect_t>& damage) {
+    hwc_region region = {damage.size(), damage.data()};
+    int32_t err = mDevice->setLayerSurfaceDamage(display, layer, region);
+    return static_cast<Error>(err);
+}
+
+Error ComposerHal::setLayerColor(Display display, Layer layer, IComposerClient::Color color) {
+    hwc_color_t hwcColor{color.r, color.g, color.b, color.a};
+    int32_t err = mDevice->setLayerColor(display, layer, hwcColor);
+    return static_cast<Error>(err);
+}
+
 }  // namespace implementation
 }  // namespace V2_1
 }  // namespace composer
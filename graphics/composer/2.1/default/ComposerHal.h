@@ -27,6 +27,12 @@ class ComposerHal {
 	ComposerHal();
 
 	std::string dumpDebugInfo();
+    std::vector<hwc2_capability_t> getCapabilities();
+    bool hasCapability(hwc2_capability_t capability) const;
+    // called when an executeCommands() batch arrives and once it is parsed,
+    // allocated when its scratch buffers grew
+    void beginCommandBatch() { mDevice->onCommandBatch(); }
+    void recordCommandBatch(bool allocated);
 
     class EventCallback {
        public:
@@ -45,10 +51,20 @@ class ComposerHal {
     Error getDisplayAttribute(Display display, Config config,
                               IComposerClient::Attribute attribute, int32_t* outValue);
     Error getDisplayName(Display display, hidl_string* outName);
+    Error getDisplayType(Display display, IComposerClient::DisplayType* outType);
+    Error getDozeSupport(Display display, bool* outSupport);
+    Error getDisplayConfigs(Display display, hidl_vec<Config>* outConfigs);
+    Error getActiveConfig(Display display, Config* outConfig);
+    Error setActiveConfig(Display display, Config config);
+    Error getColorModes(Display display, hidl_vec<ColorMode>* outModes);
+    Error setColorMode(Display display, ColorMode mode);
+    Error setColorTransform(Display display, const float* matrix, int32_t hint);
+    Error setPowerMode(Display display, IComposerClient::PowerMode mode);
 
     Error setVsyncEnabled(Display display, IComposerClient::Vsync enabled);
     Error setClientTarget(Display display, buffer_handle_t target, int32_t acquireFence,
                           int32_t dataspace, const std::vector<hwc_rect_t>& damage);
+    Error prepareClientTarget(Display display, buffer_handle_t target);
     Error validateDisplay(Display display, std::vector<Layer>* outChangedLayers,
                           std::vector<IComposerClient::Composition>* outCompositionTypes,
                           uint32_t* outDisplayRequestMask, std::vector<Layer>* outRequestedLayers,
@@ -58,6 +74,21 @@ class ComposerHal {
     Error acceptDisplayChanges(Display display);
 
     Error setLayerCompositionType(Display display, Layer layer, int32_t type);
+    Error setLayerBuffer(Display display, Layer layer, buffer_handle_t buffer,
+                         int32_t acquireFence);
+    Error setLayerDisplayFrame(Display display, Layer layer, const hwc_rect_t& frame);
+    Error setLayerSourceCrop(Display display, Layer layer, const hwc_frect_t& crop);
+    Error setLayerCursorPosition(Display display, Layer layer, int32_t x, int32_t y);
+    Error setLayerTransform(Display display, Layer layer, int32_t transform);
+    Error setLayerZOrder(Display display, Layer layer, uint32_t z);
+    Error setLayerBlendMode(Display display, Layer layer, int32_t mode);
+    Error setLayerPlaneAlpha(Display display, Layer layer, float alpha);
+    Error setLayerDataspace(Display display, Layer layer, int32_t dataspace);
+    Error setLayerVisibleRegion(Display display, Layer layer,
+                                const std::vector<hwc_rect_t>& visible);
+    Error setLayerSurfaceDamage(Display display, Layer layer,
+                                const std::vector<hwc_rect_t>& damage);
+    Error setLayerColor(Display display, Layer layer, IComposerClient::Color color);
 
   private:
 
@@ -80,6 +111,10 @@ class ComposerHal {
 
     EventCallback* mEventCallback = nullptr;
     std::atomic<bool> mMustValidateDisplay{true};
+
+    std::atomic<uint64_t> mCommandBatches{0};
+    // batches that grew the scratch buffers of the command engine
+    std::atomic<uint64_t> mCommandBatchAllocs{0};
 };
 
 }  // namespace implementation
@@ -0,0 +1,145 @@
+#define LOG_TAG "composer@2.1-FrameTimeline"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "FrameTimeline.h"
+
+namespace android {
+
+// The slot is marked empty while its stamps are reset, so that a reader
+// never takes stamps of the previous frame for the new one.
+void FrameTimeline::begin(uint64_t frame, int64_t batch) {
+    Entry& entry = mEntries[frame % kFrames];
+    entry.frame.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (auto& stamp : entry.stamps) {
+        stamp.store(0, std::memory_order_relaxed);
+    }
+    // a vsync counts for the first frame opened after it
+    entry.stamps[kVsync].store(mLastVsync.exchange(0, std::memory_order_relaxed),
+                               std::memory_order_relaxed);
+    entry.stamps[kBatch].store(batch, std::memory_order_relaxed);
+    entry.frame.store(frame, std::memory_order_release);
+    mFrames.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FrameTimeline::record(uint64_t frame, Stage stage, int64_t timestamp) {
+    Entry& entry = mEntries[frame % kFrames];
+    if (frame == 0 || entry.frame.load(std::memory_order_acquire) != frame) {
+        return;
+    }
+    entry.stamps[stage].store(timestamp, std::memory_order_relaxed);
+
+    if (stage == kFlipDone) {
+        int64_t present = entry.stamps[kPresent].load(std::memory_order_relaxed);
+        int64_t period = mPeriod.load(std::memory_order_relaxed);
+        if (present != 0 && period > 0 && timestamp > present) {
+            uint64_t missed = uint64_t((timestamp - present) / period);
+            if (missed != 0) {
+                mLateFrames.fetch_add(1, std::memory_order_relaxed);
+                mMissedVblanks.fetch_add(missed, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+bool FrameTimeline::read(size_t slot, Frame* outFrame) const {
+    const Entry& entry = mEntries[slot];
+    uint64_t frame = entry.frame.load(std::memory_order_acquire);
+    if (frame == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < kStageCount; i++) {
+        outFrame->stamps[i] = entry.stamps[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.frame.load(std::memory_order_relaxed) != frame) {
+        return false;
+    }
+    outFrame->frame = frame;
+    return true;
+}
+
+namespace {
+
+int64_t percentile(std::vector<int64_t>& values, size_t pct) {
+    size_t n = (values.size() - 1) * pct / 100;
+    std::nth_element(values.begin(), values.begin() + n, values.end());
+    return values[n];
+}
+
+} // namespace
+
+void FrameTimeline::dump(std::stringstream& output) const {
+    std::vector<Frame> frames;
+    frames.reserve(kFrames);
+    for (size_t i = 0; i < kFrames; i++) {
+        Frame frame;
+        if (read(i, &frame)) {
+            frames.push_back(frame);
+        }
+    }
+    if (frames.empty()) {
+        return;
+    }
+    std::sort(frames.begin(), frames.end(),
+              [](const Frame& a, const Frame& b) { return a.frame < b.frame; });
+
+    output << "  frames: " << mFrames.load() << ", late " << mLateFrames.load()
+           << ", missed vblanks " << mMissedVblanks.load() << "\n";
+
+    static const struct {
+        const char* name;
+        Stage from;
+        Stage to;
+    } kIntervals[] = {
+        {"batch to present", kBatch, kPresent},
+        {"present to submit", kPresent, kFlipSubmit},
+        {"submit to flip", kFlipSubmit, kFlipDone},
+        {"vsync to flip", kVsync, kFlipDone},
+    };
+    std::vector<int64_t> values;
+    values.reserve(frames.size());
+    for (const auto& interval : kIntervals) {
+        values.clear();
+        for (const auto& frame : frames) {
+            int64_t from = frame.stamps[interval.from];
+            int64_t to = frame.stamps[interval.to];
+            if (from != 0 && to >= from) {
+                values.push_back(to - from);
+            }
+        }
+        if (values.empty()) {
+            continue;
+        }
+        output << "  " << interval.name << " p50/p90/p99: " << percentile(values, 50) / 1000
+               << "/" << percentile(values, 90) / 1000 << "/" << percentile(values, 99) / 1000
+               << " us (" << values.size() << " frames)\n";
+    }
+
+    // stages of the last frames, in us from the present
+    static const char* const kStageNames[kStageCount] = {
+        "vsync", "batch", "validate", "present", "submit", "flip",
+    };
+    static constexpr size_t kLastFrames = 8;
+    size_t first = frames.size() > kLastFrames ? frames.size() - kLastFrames : 0;
+    for (size_t i = first; i < frames.size(); i++) {
+        const auto& frame = frames[i];
+        int64_t present = frame.stamps[kPresent];
+        output << "    frame " << frame.frame << ":";
+        for (size_t stage = 0; stage < kStageCount; stage++) {
+            output << " " << kStageNames[stage] << " ";
+            if (frame.stamps[stage] == 0 || present == 0) {
+                output << "-";
+            } else {
+                output << (frame.stamps[stage] - present) / 1000;
+            }
+        }
+        output << "\n";
+    }
+}
+
+} // namespace android
@@ -0,0 +1,59 @@
+#ifndef _FRAME_TIMELINE_H_
+#define _FRAME_TIMELINE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <sstream>
+
+namespace android {
+
+// Timestamps of the stages of the last frames of a display, kept in a
+// fixed ring.  The thread presenting the display opens frames, the DRM
+// event thread and the vsync thread add their stages later.  Nothing is
+// locked: a stage only lands in a slot that still holds its frame, and
+// the dump skips slots reused while it read them.
+class FrameTimeline {
+public:
+    enum Stage : uint32_t {
+        kVsync,       // first vsync delivered after the previous frame opened
+        kBatch,       // command batch received
+        kValidate,
+        kPresent,
+        kFlipSubmit,
+        kFlipDone,    // kernel timestamp of the flip
+        kStageCount,
+    };
+    static constexpr size_t kFrames = 128;
+
+    // frames are numbered from 1, batch is 0 when unknown
+    void begin(uint64_t frame, int64_t batch);
+    void record(uint64_t frame, Stage stage, int64_t timestamp);
+    void recordVsync(int64_t timestamp) { mLastVsync.store(timestamp, std::memory_order_relaxed); }
+    void setPeriod(int64_t period) { mPeriod.store(period, std::memory_order_relaxed); }
+
+    void dump(std::stringstream& output) const;
+
+private:
+    struct Entry {
+        std::atomic<uint64_t> frame{0};  // 0 while the slot is reset
+        std::atomic<int64_t> stamps[kStageCount]{};
+    };
+    struct Frame {
+        uint64_t frame;
+        int64_t stamps[kStageCount];
+    };
+    bool read(size_t slot, Frame* outFrame) const;
+
+    Entry mEntries[kFrames];
+    std::atomic<int64_t> mLastVsync{0};
+    std::atomic<int64_t> mPeriod{0};
+    std::atomic<uint64_t> mFrames{0};
+    // vblanks between present and the flip, beyond the first one
+    std::atomic<uint64_t> mMissedVblanks{0};
+    std::atomic<uint64_t> mLateFrames{0};
+};
+
+} // namespace android
+
+#endif // _FRAME_TIMELINE_H_
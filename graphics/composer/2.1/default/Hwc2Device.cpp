@@ -1,10 +1,12 @@
 #define LOG_TAG "composer@2.1-Hwc2Device"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 //#define LOG_NDEBUG 0
 #include <android-base/logging.h>
 #include <utils/Log.h>
 #include <utils/Trace.h>
 
 #include <sys/prctl.h>
+#include <algorithm>
 #include <sstream>
 
 #include <sync/sync.h>
@@ -18,32 +20,214 @@ Hwc2Device::Hwc2Device()
     ALOGV("Hwc2Device()");
     mHwcContext = std::make_unique<hwc_context>();
 
-    mFbInfo.name = "hwc-rpi3";
-    mFbInfo.width = mHwcContext->width;
-    mFbInfo.height = mHwcContext->height;
-    mFbInfo.format = mHwcContext->format;
-    mFbInfo.vsync_period_ns = int(1e9 / mHwcContext->fps);
-    mFbInfo.xdpi_scaled = int(mHwcContext->xdpi * 1000.0f);
-    mFbInfo.ydpi_scaled = int(mHwcContext->ydpi * 1000.0f);
+    for (uint32_t i = 0; i < mHwcContext->num_displays(); i++) {
+        mDisplays.push_back(std::make_unique<Display>(i, mHwcContext.get()));
+    }
+    mHwcContext->set_hotplug_callback(hotplugHook, this);
+    mHwcContext->set_flip_callback(flipHook, this);
+}
+
+Hwc2Device::Display::Display(hwc2_display_t id, hwc_context* context)
+    : mId(id), mContext(context), mLayers(uint8_t(id)) {
+    mName = id == 0 ? "hwc-rpi3" : "hwc-rpi3-" + std::to_string(id);
+    mLayerCounter = mName + " layers";
+    mDeviceLayerCounter = mName + " device layers";
+    mConnected = mContext->is_connected(uint32_t(id));
+    loadConfigs();
+    // typical frames fit without growing the layer table
+    mLayers.reserve(kLayerReserve);
+    // every device layer has a plane of its own
+    mKmsLayers.reserve(KMS_MAX_PLANES);
+
+    initPlanes();
+
+    mVsyncThread.setConnected(mConnected);
+    mVsyncThread.setTimeline(&mTimeline);
+    mVsyncThread.start(id, 0, getInfo().vsync_period_ns, mContext);
+}
+
+void Hwc2Device::Display::loadConfigs() {
+    const kms_output* output = mContext->get_output(uint32_t(mId));
+
+    mConfigs.clear();
+    for (uint32_t i = 0; i < output->num_modes; i++) {
+        const drmModeModeInfo& mode = output->modes[i];
+        Info info;
+        info.width = mode.hdisplay;
+        info.height = mode.vdisplay;
+        info.format = output->fb_format;
+        info.vsync_period_ns = int(drm_mode_period_ns(&mode));
+        info.xdpi_scaled = 75000;
+        info.ydpi_scaled = 75000;
+        if (output->mm_width && output->mm_height) {
+            info.xdpi_scaled = int(mode.hdisplay * 25400.0f / output->mm_width);
+            info.ydpi_scaled = int(mode.vdisplay * 25400.0f / output->mm_height);
+        }
+        mConfigs.push_back(info);
+    }
+    mActiveConfig = output->active_mode;
+}
+
+// A sink coming back may have other modes than the one that left, the
+// configs are reloaded before the client is told about it.  Runs on the
+// hotplug thread with mStateMutex held.
+void Hwc2Device::Display::onHotplug(bool connected) {
+    mConnected = connected;
+    if (connected) {
+        loadConfigs();
+        mVsyncThread.setPeriod(getInfo().vsync_period_ns);
+    }
+    mClientTargetOnScreen = false;
+    invalidate();
+    mVsyncThread.setConnected(connected);
+}
+
+void Hwc2Device::hotplugHook(void* data, uint32_t display, int connected) {
+    static_cast<Hwc2Device*>(data)->onHotplug(display, connected != 0);
+}
+
+void Hwc2Device::flipHook(void* data, uint32_t display, uint64_t frame, int64_t timestamp,
+                          int done) {
+    auto device = static_cast<Hwc2Device*>(data);
+    auto target = device->getDisplay(display);
+    if (target) {
+        target->getTimeline().record(frame, done ? FrameTimeline::kFlipDone
+                                                 : FrameTimeline::kFlipSubmit, timestamp);
+    }
+}
+
+void Hwc2Device::onCommandBatch() {
+    mLastBatch.store(VsyncThread::now(), std::memory_order_relaxed);
+}
+
+void Hwc2Device::onHotplug(hwc2_display_t displayId, bool connected) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mStateMutex);
+        display->onHotplug(connected);
+    }
+
+    // the client cannot live without a primary display, it only hears
+    // about the primary coming back so that it reloads the configs
+    std::lock_guard<std::mutex> lock(mHotplugMutex);
+    if (mHotplugCallback && (connected || displayId != 0)) {
+        mHotplugCallback(mHotplugCallbackData, displayId,
+                         connected ? HWC2_CONNECTION_CONNECTED : HWC2_CONNECTION_DISCONNECTED);
+    }
+}
+
+Hwc2Device::Display::~Display() {
+    for (auto& layer : mLayers) {
+        closeFence(&layer.acquireFence);
+    }
+    closeFence(&mBufferFence);
+    clearReleaseFences();
+    mVsyncThread.stop();
+}
+
+const Hwc2Device::Info* Hwc2Device::Display::getConfig(hwc2_config_t config) const {
+    return config < mConfigs.size() ? &mConfigs[config] : nullptr;
+}
+
+// Configs map to connector modes, switching is a modeset of the crtc.
+// The client target keeps its old size until the client reallocates it,
+// so the first frame after the switch is fully damaged.
+bool Hwc2Device::Display::setActiveConfig(hwc2_config_t config) {
+    if (config >= mConfigs.size()) {
+        return false;
+    }
+    if (config == mActiveConfig) {
+        return true;
+    }
+    int err = mContext->set_mode(uint32_t(mId), config);
+    if (err != 0) {
+        ALOGE("failed to switch display %" PRIu64 " to config %u (%d)", mId, config, err);
+        return false;
+    }
+    mActiveConfig = config;
+    mClientTargetOnScreen = false;
+    // a dozing display keeps its lower refresh rate
+    mVsyncThread.setPeriod(mContext->vsync_period_ns(uint32_t(mId)));
+    invalidate();
+    return true;
+}
+
+// Off turns the crtc off, doze drops it to the lowest refresh rate of the
+// active config.  Doze suspend is doze without composition, so like off
+// it parks the vsync thread.
+bool Hwc2Device::Display::setPowerMode(int32_t mode) {
+    int kmsMode;
+    switch (mode) {
+        case HWC2_POWER_MODE_OFF:
+            kmsMode = KMS_POWER_OFF;
+            break;
+        case HWC2_POWER_MODE_DOZE:
+        case HWC2_POWER_MODE_DOZE_SUSPEND:
+            kmsMode = KMS_POWER_DOZE;
+            break;
+        default:
+            kmsMode = KMS_POWER_ON;
+            break;
+    }
+    int err = mContext->set_power_mode(uint32_t(mId), kmsMode);
+    if (err != 0) {
+        ALOGE("failed to set display %" PRIu64 " to power mode %d (%d)", mId, mode, err);
+        return false;
+    }
+    mPowerMode = mode;
+    mVsyncThread.setPeriod(mContext->vsync_period_ns(uint32_t(mId)));
+    mVsyncThread.setPowered(mode == HWC2_POWER_MODE_ON || mode == HWC2_POWER_MODE_DOZE);
+    invalidate();
+    return true;
+}
 
-    mVsyncThread.start(0, mFbInfo.vsync_period_ns);
+Hwc2Device::Display* Hwc2Device::getDisplay(hwc2_display_t displayId) {
+    return displayId < mDisplays.size() ? mDisplays[displayId].get() : nullptr;
+}
+
+void Hwc2Device::getCapabilities(uint32_t* outCount, int32_t* outCapabilities) {
+    uint32_t count = 0;
+    if (!mHwcContext->present_fence_reliable()) {
+        if (outCapabilities && count < *outCount) {
+            outCapabilities[count] = HWC2_CAPABILITY_PRESENT_FENCE_IS_NOT_RELIABLE;
+        }
+        count++;
+    }
+    // unchanged frames are presented without validating, see setLayerBuffer()
+    if (outCapabilities && count < *outCount) {
+        outCapabilities[count] = HWC2_CAPABILITY_SKIP_VALIDATE;
+    }
+    count++;
+    // only when every crtc applies color transforms, see setColorTransform()
+    if (mHwcContext->color_transform_supported()) {
+        if (outCapabilities && count < *outCount) {
+            outCapabilities[count] = HWC2_CAPABILITY_SKIP_CLIENT_COLOR_TRANSFORM;
+        }
+        count++;
+    }
+    *outCount = outCapabilities ? std::min(*outCount, count) : count;
 }
 
 int32_t Hwc2Device::createLayer(hwc2_display_t displayId, hwc2_layer_t* outLayerId) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    *outLayerId = addLayer();
-    setState(State::MODIFIED);
+    *outLayerId = display->addLayer();
     return HWC2_ERROR_NONE;
 }
 
 int32_t Hwc2Device::destroyLayer(hwc2_display_t displayId, hwc2_layer_t layerId) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (removeLayer(layerId)) {
-        setState(State::MODIFIED);
+    if (display->removeLayer(layerId)) {
         return HWC2_ERROR_NONE;
     } else {
         return HWC2_ERROR_BAD_LAYER;
@@ -52,28 +236,33 @@ int32_t Hwc2Device::destroyLayer(hwc2_display_t displayId, hwc2_layer_t layerId)
 
 int32_t Hwc2Device::getClientTargetSupport(hwc2_display_t displayId, uint32_t width, uint32_t height,
                                       int32_t format, int32_t dataspace) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
     if (dataspace != HAL_DATASPACE_UNKNOWN) {
         return HWC2_ERROR_UNSUPPORTED;
     }
-    const auto& info = getInfo();
+    const auto& info = display->getInfo();
     return (info.width == width && info.height == height && info.format == format)
             ? HWC2_ERROR_NONE
             : HWC2_ERROR_UNSUPPORTED;
 }
 
 
-int32_t Hwc2Device::getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t config,
+int32_t Hwc2Device::getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t configId,
         int32_t intAttribute, int32_t* outValue) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (0 != config) {
+    auto config = display->getConfig(configId);
+    if (!config) {
         return HWC2_ERROR_BAD_CONFIG;
     }
-    const auto& info = getInfo();
+    const auto& info = *config;
     switch (intAttribute) {
         case HWC2_ATTRIBUTE_WIDTH:
             *outValue = int32_t(info.width);
@@ -97,118 +286,699 @@ int32_t Hwc2Device::getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t
 }
 
 int32_t Hwc2Device::getDisplayName(hwc2_display_t displayId, uint32_t* outSize, char* outName) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    const auto& info = mFbInfo;
+    const auto& name = display->getName();
     if (outName) {
-        *outSize = info.name.copy(outName, *outSize);
+        *outSize = name.copy(outName, *outSize);
+    } else {
+        *outSize = name.size();
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getDisplayType(hwc2_display_t displayId, int32_t* outType) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    if (!getDisplay(displayId)) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    *outType = HWC2_DISPLAY_TYPE_PHYSICAL;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getDisplayConfigs(hwc2_display_t displayId, uint32_t* outNumConfigs,
+        hwc2_config_t* outConfigs) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (outConfigs) {
+        *outNumConfigs = std::min(*outNumConfigs, display->getConfigCount());
+        for (uint32_t i = 0; i < *outNumConfigs; i++) {
+            outConfigs[i] = i;
+        }
     } else {
-        *outSize = info.name.size();
+        *outNumConfigs = display->getConfigCount();
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getActiveConfig(hwc2_display_t displayId, hwc2_config_t* outConfig) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    *outConfig = display->getActiveConfig();
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setActiveConfig(hwc2_display_t displayId, hwc2_config_t config) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (!display->getConfig(config)) {
+        return HWC2_ERROR_BAD_CONFIG;
+    }
+    return display->setActiveConfig(config) ? HWC2_ERROR_NONE : HWC2_ERROR_NO_RESOURCES;
+}
+
+int32_t Hwc2Device::getColorModes(hwc2_display_t displayId, uint32_t* outNumModes,
+        int32_t* outModes) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    if (!getDisplay(displayId)) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (outModes) {
+        if (*outNumModes > 0) {
+            outModes[0] = HAL_COLOR_MODE_NATIVE;
+            *outNumModes = 1;
+        }
+    } else {
+        *outNumModes = 1;
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setColorMode(hwc2_display_t displayId, int32_t mode) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    if (!getDisplay(displayId)) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    return mode == HAL_COLOR_MODE_NATIVE ? HWC2_ERROR_NONE : HWC2_ERROR_BAD_PARAMETER;
+}
+
+int32_t Hwc2Device::setColorTransform(hwc2_display_t displayId, const float* matrix,
+        int32_t hint) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (hint < HAL_COLOR_TRANSFORM_IDENTITY || hint > HAL_COLOR_TRANSFORM_CORRECT_TRITANOPIA) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    display->setColorTransform(matrix, hint);
+    return HWC2_ERROR_NONE;
+}
+
+// The crtc applies the transform after the planes are blended, so layers
+// keep their planes.  That needs SKIP_CLIENT_COLOR_TRANSFORM, or the client
+// target would be transformed twice.  Without it the client applies the
+// transform while compositing, so every layer goes to the client.
+void Hwc2Device::Display::setColorTransform(const float* matrix, int32_t hint) {
+    static const float kIdentity[16] = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+        0.0f, 0.0f, 0.0f, 1.0f,
+    };
+    if (hint == HAL_COLOR_TRANSFORM_IDENTITY) {
+        matrix = kIdentity;
+    }
+    mClientColorTransform = hint != HAL_COLOR_TRANSFORM_IDENTITY;
+    if (mContext->color_transform_supported()) {
+        int err = mContext->set_color_transform(uint32_t(mId), matrix);
+        if (err == 0) {
+            mClientColorTransform = false;
+        } else {
+            ALOGE("crtc of display %" PRIu64 " rejected a color transform (%d)", mId, err);
+        }
+    }
+    mColorTransformHint = hint;
+    mClientTargetOnScreen = false;
+    invalidate();
+}
+
+int32_t Hwc2Device::getDozeSupport(hwc2_display_t displayId, int32_t* outSupport) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    if (!getDisplay(displayId)) {
+        return HWC2_ERROR_BAD_DISPLAY;
     }
+    // dozing needs no more than the crtc, at worst at the same refresh rate
+    *outSupport = 1;
     return HWC2_ERROR_NONE;
 }
 
+int32_t Hwc2Device::setPowerMode(hwc2_display_t displayId, int32_t intMode) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (intMode != HWC2_POWER_MODE_OFF && intMode != HWC2_POWER_MODE_DOZE &&
+            intMode != HWC2_POWER_MODE_DOZE_SUSPEND && intMode != HWC2_POWER_MODE_ON) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    return display->setPowerMode(intMode) ? HWC2_ERROR_NONE : HWC2_ERROR_UNSUPPORTED;
+}
+
 int32_t Hwc2Device::setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    mVsyncThread.enableCallback(intEnabled == HWC2_VSYNC_ENABLE);
+    display->getVsyncThread().enableCallback(intEnabled == HWC2_VSYNC_ENABLE);
     return HWC2_ERROR_NONE;
 }
 
 
 int32_t Hwc2Device::setClientTarget(hwc2_display_t displayId, buffer_handle_t target,
-        int32_t acquireFence, int32_t dataspace, hwc_region_t /*damage*/) {
+        int32_t acquireFence, int32_t dataspace, hwc_region_t damage) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
     ALOGV("setClientTarget(%p, %d)", target, acquireFence);
-    if (acquireFence >= 0) {
-        sync_wait(acquireFence, -1);
-        close(acquireFence);
-    }
-    if (0 != displayId) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        closeFence(&acquireFence);
         return HWC2_ERROR_BAD_DISPLAY;
     }
     if (dataspace != HAL_DATASPACE_UNKNOWN) {
+        closeFence(&acquireFence);
         return HWC2_ERROR_BAD_PARAMETER;
     }
+    display->setClientTarget(target, acquireFence, damage);
+    return HWC2_ERROR_NONE;
+}
+
+// The acquire fence is kept until present, which hands it to the commit.
+void Hwc2Device::Display::setClientTarget(buffer_handle_t target, int32_t acquireFence,
+                                          const hwc_region_t& damage) {
     mBuffer = target;
+    closeFence(&mBufferFence);
+    mBufferFence = acquireFence;
+    setClientTargetDamage(damage);
+}
+
+// No rects means the damage is unknown and the whole target is redrawn.
+// Rects beyond what a kms_damage holds are merged into their bounds.
+void Hwc2Device::Display::setClientTargetDamage(const hwc_region_t& damage) {
+    kms_damage& out = mClientTargetDamage;
+    out.count = 0;
+    if (damage.numRects == 0) {
+        return;
+    }
+
+    auto clip = [this](const hwc_rect_t& rect) {
+        kms_rect clipped;
+        clipped.x1 = std::max(rect.left, 0);
+        clipped.y1 = std::max(rect.top, 0);
+        clipped.x2 = std::max(std::min(rect.right, int32_t(getInfo().width)), clipped.x1);
+        clipped.y2 = std::max(std::min(rect.bottom, int32_t(getInfo().height)), clipped.y1);
+        return clipped;
+    };
+
+    if (damage.numRects <= KMS_MAX_DAMAGE_RECTS) {
+        for (size_t i = 0; i < damage.numRects; i++) {
+            out.rects[out.count++] = clip(damage.rects[i]);
+        }
+        return;
+    }
+
+    hwc_rect_t bounds = damage.rects[0];
+    for (size_t i = 1; i < damage.numRects; i++) {
+        bounds.left = std::min(bounds.left, damage.rects[i].left);
+        bounds.top = std::min(bounds.top, damage.rects[i].top);
+        bounds.right = std::max(bounds.right, damage.rects[i].right);
+        bounds.bottom = std::max(bounds.bottom, damage.rects[i].bottom);
+    }
+    out.rects[out.count++] = clip(bounds);
+}
+
+void Hwc2Device::Display::recordClientTargetDamage() {
+    uint64_t screen = uint64_t(getInfo().width) * getInfo().height;
+    uint64_t area = 0;
+    for (uint32_t i = 0; i < mClientTargetDamage.count; i++) {
+        const kms_rect& rect = mClientTargetDamage.rects[i];
+        area += uint64_t(rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+    }
+    // overlapping rects are counted twice, an upper bound is good enough
+    if (mClientTargetDamage.count == 0 || area > screen) {
+        area = screen;
+    }
+    if (area == screen) {
+        mFullDamageFrames++;
+    }
+    mDamageFrames++;
+    mDamagedPixels += area;
+}
+
+int32_t Hwc2Device::prepareClientTarget(hwc2_display_t displayId, buffer_handle_t target) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    if (!getDisplay(displayId)) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    // create the fb now rather than on the first present of the buffer
+    if (mHwcContext->prepare_fb(target) != 0) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
     return HWC2_ERROR_NONE;
 }
 
 int32_t Hwc2Device::validateDisplay(hwc2_display_t displayId, uint32_t* outNumTypes,
         uint32_t* outNumRequests) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    ATRACE_CALL();
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    const auto& dirtyLayers = getDirtyLayers();
-    *outNumTypes = dirtyLayers.size();
+    display->beginFrame(mLastBatch.load(std::memory_order_relaxed));
+    display->getTimeline().record(display->getFrame(), FrameTimeline::kValidate,
+                                  VsyncThread::now());
+    display->assignPlanes();
+    *outNumTypes = display->getChangedTypeCount();
     *outNumRequests = 0;
-    ALOGV("validateDisplay() %u types", *outNumTypes);
+    ALOGV("validateDisplay(%" PRIu64 ") %u types", displayId, *outNumTypes);
     if (*outNumTypes > 0) {
-        setState(State::VALIDATED_WITH_CHANGES);
+        display->setState(State::VALIDATED_WITH_CHANGES);
         return HWC2_ERROR_HAS_CHANGES;
     } else {
-        setState(State::VALIDATED);
+        display->setState(State::VALIDATED);
         return HWC2_ERROR_NONE;
     }
 }
 
 int32_t Hwc2Device::presentDisplay(hwc2_display_t displayId, int32_t* outRetireFence) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    ATRACE_CALL();
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (getState() != State::VALIDATED) {
+    if (display->getState() != State::VALIDATED) {
         return HWC2_ERROR_NOT_VALIDATED;
     }
-    ALOGV("presentDisplay(%p)", mBuffer);
-    mHwcContext->hwc_post(mBuffer);
-    *outRetireFence = -1;
+    int64_t start = VsyncThread::now();
+    display->beginFrame(mLastBatch.load(std::memory_order_relaxed));
+    display->getTimeline().record(display->getFrame(), FrameTimeline::kPresent, start);
+    display->present(outRetireFence);
+    recordPresentTime(VsyncThread::now() - start);
     return HWC2_ERROR_NONE;
 }
 
+int Hwc2Device::Display::present(int32_t* outPresentFence) {
+    ALOGV("present(%" PRIu64 ", %p)", mId, mBuffer);
+    // acquire fences go along with the frame, the commit waits for them
+    auto& layers = mKmsLayers;
+    layers.clear();
+    for (auto& layer : mLayers) {
+        if (layer.plane >= 0) {
+            layers.push_back(toKmsLayer(layer));
+            layers.back().acquire_fence = layer.acquireFence;
+            layer.acquireFence = -1;
+        } else {
+            // composited by the client, which waited for it
+            closeFence(&layer.acquireFence);
+        }
+    }
+    // damage is relative to the previous client target, which is only
+    // what the primary plane shows if the last frame used one as well
+    if (!mClientTargetOnScreen) {
+        mClientTargetDamage.count = 0;
+    }
+    mPresentCount++;
+    if (!mValidatedSincePresent) {
+        mSkippedValidations++;
+    }
+    mValidatedSincePresent = false;
+    int targetFence = mClientTargetNeeded ? mBufferFence : -1;
+    if (mClientTargetNeeded) {
+        mBufferFence = -1;
+    } else {
+        closeFence(&mBufferFence);
+    }
+    uint64_t frame = mFrame++;
+    mFrameOpen = false;
+    int err = mContext->hwc_post(uint32_t(mId), frame,
+                                 mClientTargetNeeded ? mBuffer : nullptr, targetFence,
+                                 &mClientTargetDamage, layers.data(), layers.size(),
+                                 outPresentFence);
+    if (err == 0) {
+        mClientTargetOnScreen = mClientTargetNeeded;
+        if (mClientTargetNeeded) {
+            recordClientTargetDamage();
+        }
+    }
+    clearReleaseFences();
+    if (err == 0) {
+        collectReleaseFences(*outPresentFence);
+    }
+    return err;
+}
+
+void Hwc2Device::recordPresentTime(int64_t ns) {
+    size_t bucket = 0;
+    int64_t limit = kPresentBucketUs * 1000;
+    while (bucket < kPresentBuckets - 1 && ns >= limit) {
+        bucket++;
+        limit *= 2;
+    }
+    mPresentHistogram[bucket]++;
+}
+
+int32_t Hwc2Device::getReleaseFences(hwc2_display_t displayId, uint32_t* outNumElements,
+        hwc2_layer_t* outLayers, int32_t* outFences) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    display->getReleaseFences(outNumElements, outLayers, outFences);
+    return HWC2_ERROR_NONE;
+}
+
+void Hwc2Device::Display::getReleaseFences(uint32_t* outNumElements, hwc2_layer_t* outLayers,
+        int32_t* outFences) {
+    if (outLayers && outFences) {
+        // ownership of the fences goes to the caller
+        *outNumElements = std::min(*outNumElements, uint32_t(mReleaseFences.size()));
+        for (uint32_t i = 0; i < *outNumElements; i++) {
+            outLayers[i] = mReleaseFences[i].first;
+            outFences[i] = mReleaseFences[i].second;
+        }
+        mReleaseFences.clear();
+    } else {
+        *outNumElements = mReleaseFences.size();
+    }
+}
+
 int32_t Hwc2Device::acceptDisplayChanges(hwc2_display_t displayId) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (getState() == State::MODIFIED) {
+    if (display->getState() == State::MODIFIED) {
         return HWC2_ERROR_NOT_VALIDATED;
     }
-    clearDirtyLayers();
-    setState(State::VALIDATED);
+    display->acceptChanges();
     return HWC2_ERROR_NONE;
 }
 
+void Hwc2Device::Display::acceptChanges() {
+    for (size_t i = mLayers.nextFlag(0); i < mLayers.size(); i = mLayers.nextFlag(i + 1)) {
+        mLayers[i].compositionType = mLayers[i].validatedType;
+    }
+    mLayers.clearFlags();
+    setState(State::VALIDATED);
+}
+
 int32_t Hwc2Device::getChangedCompositionTypes(hwc2_display_t displayId, uint32_t* outNumElements,
         hwc2_layer_t* outLayers, int32_t* outTypes){
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (getState() == State::MODIFIED) {
+    if (display->getState() == State::MODIFIED) {
         return HWC2_ERROR_NOT_VALIDATED;
     }
-    const auto& dirtyLayers = getDirtyLayers();
+    display->getChangedCompositionTypes(outNumElements, outLayers, outTypes);
+    return HWC2_ERROR_NONE;
+}
+
+void Hwc2Device::Display::getChangedCompositionTypes(uint32_t* outNumElements,
+        hwc2_layer_t* outLayers, int32_t* outTypes) {
     if (outLayers && outTypes) {
-        *outNumElements = std::min(*outNumElements, uint32_t(dirtyLayers.size()));
-        auto iter = dirtyLayers.cbegin();
-        for (uint32_t i = 0; i < *outNumElements; i++) {
-            outLayers[i] = *iter++;
-            outTypes[i] = HWC2_COMPOSITION_CLIENT;
+        uint32_t count = 0;
+        for (size_t i = mLayers.nextFlag(0); i < mLayers.size() && count < *outNumElements;
+                i = mLayers.nextFlag(i + 1)) {
+            outLayers[count] = mLayers.idAt(i);
+            outTypes[count] = mLayers[i].validatedType;
+            count++;
         }
+        *outNumElements = count;
     } else {
-        *outNumElements = dirtyLayers.size();
+        *outNumElements = getChangedTypeCount();
     }
-    return HWC2_ERROR_NONE;
 }
 
 int32_t Hwc2Device::setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
         int32_t intType) {
-    if (0 != displayId) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (!markLayerDirty(layerId, intType != HWC2_COMPOSITION_CLIENT)) {
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
         return HWC2_ERROR_BAD_LAYER;
     }
-    setState(State::MODIFIED);
+    if (layer->compositionType != intType) {
+        layer->compositionType = intType;
+        display->setLayerDirty(*layer, kDirtyCompositionType);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+// A new buffer on a plane is scanned out without validating again as long
+// as the plane takes its format.
+// A buffer replaced before it was presented is not waited for.
+void Hwc2Device::Display::setLayerBuffer(LayerState& layer, buffer_handle_t buffer,
+                                         int32_t acquireFence) {
+    bool sameFormat = buffer && layer.buffer &&
+            mContext->buffer_format(buffer) == mContext->buffer_format(layer.buffer);
+    layer.buffer = buffer;
+    closeFence(&layer.acquireFence);
+    layer.acquireFence = acquireFence;
+    setLayerDirty(layer, sameFormat ? kDirtyBuffer : kDirtyBuffer | kDirtyBufferFormat);
+}
+
+// Regions are only kept as their bounds.
+void Hwc2Device::Display::setLayerRegion(LayerState& layer, const hwc_region_t& region,
+                                         bool damage) {
+    hwc_rect_t bounds{};
+    if (region.numRects > 0) {
+        bounds = region.rects[0];
+        for (size_t i = 1; i < region.numRects; i++) {
+            bounds.left = std::min(bounds.left, region.rects[i].left);
+            bounds.top = std::min(bounds.top, region.rects[i].top);
+            bounds.right = std::max(bounds.right, region.rects[i].right);
+            bounds.bottom = std::max(bounds.bottom, region.rects[i].bottom);
+        }
+    }
+    if (damage) {
+        if (layer.damageRects != region.numRects || !sameRect(layer.damageBounds, bounds)) {
+            layer.damageRects = uint32_t(region.numRects);
+            layer.damageBounds = bounds;
+            setLayerDirty(layer, kDirtySurfaceDamage);
+        }
+    } else if (!sameRect(layer.visibleBounds, bounds)) {
+        layer.visibleBounds = bounds;
+        setLayerDirty(layer, kDirtyVisibleRegion);
+    }
+}
+
+int32_t Hwc2Device::setLayerBuffer(hwc2_display_t displayId, hwc2_layer_t layerId,
+        buffer_handle_t buffer, int32_t acquireFence) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        closeFence(&acquireFence);
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        closeFence(&acquireFence);
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    display->setLayerBuffer(*layer, buffer, acquireFence);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerDisplayFrame(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_rect_t frame) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (!sameRect(layer->displayFrame, frame)) {
+        layer->displayFrame = frame;
+        display->setLayerDirty(*layer, kDirtyDisplayFrame);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerSourceCrop(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_frect_t crop) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (!sameRect(layer->sourceCrop, crop)) {
+        layer->sourceCrop = crop;
+        display->setLayerDirty(*layer, kDirtySourceCrop);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setCursorPosition(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t x, int32_t y) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer || layer->compositionType != HWC2_COMPOSITION_CURSOR) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    display->setCursorPosition(*layer, x, y);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t intTransform) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->transform != intTransform) {
+        layer->transform = intTransform;
+        display->setLayerDirty(*layer, kDirtyTransform);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerZOrder(hwc2_display_t displayId, hwc2_layer_t layerId, uint32_t z) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->z != z) {
+        layer->z = z;
+        display->setLayerDirty(*layer, kDirtyZOrder);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerBlendMode(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t intMode) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->blendMode != intMode) {
+        layer->blendMode = intMode;
+        display->setLayerDirty(*layer, kDirtyBlendMode);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerPlaneAlpha(hwc2_display_t displayId, hwc2_layer_t layerId,
+        float alpha) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->planeAlpha != alpha) {
+        layer->planeAlpha = alpha;
+        display->setLayerDirty(*layer, kDirtyPlaneAlpha);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerDataspace(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t dataspace) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->dataspace != dataspace) {
+        layer->dataspace = dataspace;
+        display->setLayerDirty(*layer, kDirtyDataspace);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerVisibleRegion(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_region_t visible) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    display->setLayerRegion(*layer, visible, false);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerSurfaceDamage(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_region_t damage) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    display->setLayerRegion(*layer, damage, true);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerColor(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_color_t color) {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->color.r != color.r || layer->color.g != color.g || layer->color.b != color.b ||
+            layer->color.a != color.a) {
+        layer->color = color;
+        display->setLayerDirty(*layer, kDirtyColor);
+    }
     return HWC2_ERROR_NONE;
 }
 
@@ -220,25 +990,127 @@ void Hwc2Device::dump(uint32_t* outSize, char* outBuffer)
         return;
     }
 
+    std::lock_guard<std::mutex> lock(mStateMutex);
     std::stringstream output;
     output << "-- hwc-rpi3 --\n";
+    output << "commit path: " << (mHwcContext->atomic_enabled() ? "atomic" : "legacy") << "\n";
+    dumpCommitStats(output, "atomic", mHwcContext->atomic_stats);
+    dumpCommitStats(output, "legacy", mHwcContext->legacy_stats);
+    dumpPresentHistogram(output);
+    const fb_cache_stats& fbStats = mHwcContext->fb_stats;
+    output << "fb cache: " << fbStats.count << "/" << fbStats.capacity
+           << ", hits " << fbStats.hits << ", misses " << fbStats.misses
+           << ", evictions " << fbStats.evictions << "\n";
+    for (const auto& display : mDisplays) {
+        display->dump(output);
+    }
     mDumpString = output.str();
     *outSize = static_cast<uint32_t>(mDumpString.size());
 }
 
+void Hwc2Device::Display::dump(std::stringstream& output) const {
+    const auto& info = getInfo();
+    output << "display " << mId << " (" << mName << "): config " << mActiveConfig << "/"
+           << mConfigs.size() << ", " << info.width << "x" << info.height
+           << ", vsync period " << info.vsync_period_ns << " ns\n";
+    if (mPowerMode != HWC2_POWER_MODE_ON) {
+        output << "  power mode " << mPowerMode << ", vsync period "
+               << mContext->vsync_period_ns(uint32_t(mId)) << " ns\n";
+    }
+    if (mDamageFrames != 0) {
+        uint64_t screen = uint64_t(getInfo().width) * getInfo().height;
+        output << "  client target damage: " << mDamageFrames << " frames, "
+               << mFullDamageFrames << " full, avg "
+               << (screen ? mDamagedPixels * 100 / (screen * mDamageFrames) : 0)
+               << "% of the screen\n";
+    }
+    if (mValidations != 0) {
+        output << "  validations: " << mValidations << ", " << mIncrementalValidations
+               << " kept the plane assignment\n";
+    }
+    if (mPresentCount != 0) {
+        output << "  presents: " << mPresentCount << ", " << mSkippedValidations
+               << " without validation\n";
+    }
+    output << "  planes: " << mPlanes.size() << ", layers: " << mLayers.size()
+           << ", on planes: " << mDeviceLayerCount
+           << (mClientTargetNeeded ? " + client target" : "") << "\n";
+    if (mCursorPlane >= 0) {
+        output << "  cursor plane: " << mCursorMoves << " async moves\n";
+    }
+    if (mColorTransformHint != HAL_COLOR_TRANSFORM_IDENTITY) {
+        output << "  color transform: hint " << mColorTransformHint << ", "
+               << (mClientColorTransform ? "client" : "crtc") << "\n";
+    }
+    const kms_output* kms = mContext->get_output(uint32_t(mId));
+    if (kms->latch_count != 0) {
+        output << "  late latch: " << kms->latch_count << " frames held, "
+               << kms->latch_replaced << " replaced by a newer frame\n";
+    }
+    if (kms->queue_dropped != 0) {
+        output << "  flip queue: " << kms->queue_dropped << " frames dropped for newer ones\n";
+    }
+    const kms_jank& jank = kms->jank;
+    if (jank.flips != 0) {
+        output << "  flips: " << jank.flips << ", late " << jank.late << " (fence "
+               << jank.late_fence << ", present " << jank.late_present << ", commit "
+               << jank.late_commit << "), repeated vblanks " << jank.repeated
+               << ", busy " << jank.flip_busy << "\n";
+    }
+    mTimeline.dump(output);
+}
+
+void Hwc2Device::dumpCommitStats(std::stringstream& output, const char* name,
+        const commit_stats& stats) {
+    if (stats.count == 0) {
+        return;
+    }
+    output << "  " << name << " commits: " << stats.count
+           << ", avg " << stats.total_ns / int64_t(stats.count) / 1000 << " us"
+           << ", max " << stats.max_ns / 1000 << " us\n";
+}
+
+void Hwc2Device::dumpPresentHistogram(std::stringstream& output) const {
+    output << "present time:";
+    int64_t limit = kPresentBucketUs;
+    for (size_t i = 0; i < kPresentBuckets; i++) {
+        if (mPresentHistogram[i] != 0) {
+            if (i == kPresentBuckets - 1) {
+                output << " >=" << limit / 2 << "us: ";
+            } else {
+                output << " <" << limit << "us: ";
+            }
+            output << mPresentHistogram[i];
+        }
+        limit *= 2;
+    }
+    output << "\n";
+}
+
 int32_t Hwc2Device::registerCallback(int32_t intDesc, hwc2_callback_data_t callbackData,
         hwc2_function_pointer_t pointer) {
     switch (intDesc) {
-        case HWC2_CALLBACK_HOTPLUG:
-            if (pointer) {
-                reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer)(callbackData, 0,
-                                                            HWC2_CONNECTION_CONNECTED);
+        case HWC2_CALLBACK_HOTPLUG: {
+            std::lock_guard<std::mutex> lock(mHotplugMutex);
+            mHotplugCallback = reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer);
+            mHotplugCallbackData = callbackData;
+            if (mHotplugCallback) {
+                for (const auto& display : mDisplays) {
+                    if (display->isConnected() || display->getId() == 0) {
+                        mHotplugCallback(mHotplugCallbackData, display->getId(),
+                                         HWC2_CONNECTION_CONNECTED);
+                    }
+                }
             }
             break;
+        }
         case HWC2_CALLBACK_REFRESH:
             break;
         case HWC2_CALLBACK_VSYNC:
-            mVsyncThread.setCallback(reinterpret_cast<HWC2_PFN_VSYNC>(pointer), callbackData);
+            for (const auto& display : mDisplays) {
+                display->getVsyncThread().setCallback(
+                        reinterpret_cast<HWC2_PFN_VSYNC>(pointer), callbackData);
+            }
             break;
         default:
             return HWC2_ERROR_BAD_PARAMETER;
@@ -248,44 +1120,323 @@ int32_t Hwc2Device::registerCallback(int32_t intDesc, hwc2_callback_data_t callb
 }
 
 
-hwc2_layer_t Hwc2Device::addLayer() {
-    hwc2_layer_t id = ++mNextLayerId;
+hwc2_layer_t Hwc2Device::Display::addLayer() {
+    hwc2_layer_t layer = mLayers.insert(LayerState());
+    invalidate();
+    return layer;
+}
+
+// The last record takes the place of the removed one.
+bool Hwc2Device::Display::removeLayer(hwc2_layer_t layer) {
+    auto state = mLayers.get(layer);
+    if (!state) {
+        return false;
+    }
+    closeFence(&state->acquireFence);
+    mLayers.erase(layer);
+    invalidate();
+    return true;
+}
+
+// Any change to a client composited layer means the client has to compose
+// again.  A layer on a plane only needs it when its geometry changed.
+void Hwc2Device::Display::setLayerDirty(LayerState& layer, uint32_t dirty) {
+    layer.dirty |= dirty;
+    if (layer.plane < 0 || (dirty & kDirtyGeometry) != 0) {
+        setState(State::MODIFIED);
+    }
+}
+
+void Hwc2Device::Display::beginFrame(int64_t batch) {
+    if (!mFrameOpen) {
+        mTimeline.setPeriod(mContext->vsync_period_ns(uint32_t(mId)));
+        mTimeline.begin(mFrame, batch);
+        mFrameOpen = true;
+    }
+}
 
-    mLayers.insert(id);
-    mDirtyLayers.insert(id);
+void Hwc2Device::Display::invalidate() {
+    mGeometryChanged = true;
+    setState(State::MODIFIED);
+}
 
-    return id;
+// A buffer leaves the screen when the frame replacing it is flipped in,
+// which is exactly when the present fence of that frame signals.  Every
+// layer whose previously scanned out buffer is not on a plane anymore
+// gets a copy of it.
+void Hwc2Device::Display::collectReleaseFences(int32_t presentFence) {
+    for (size_t i = 0; i < mLayers.size(); i++) {
+        auto& layer = mLayers[i];
+        buffer_handle_t scanout = layer.plane >= 0 ? layer.buffer : nullptr;
+        if (layer.scanout && layer.scanout != scanout) {
+            int32_t fence = presentFence >= 0 ? dup(presentFence) : -1;
+            mReleaseFences.emplace_back(mLayers.idAt(i), fence);
+        }
+        layer.scanout = scanout;
+    }
 }
 
-bool Hwc2Device::removeLayer(hwc2_layer_t layer) {
-    mDirtyLayers.erase(layer);
-    return mLayers.erase(layer);
+void Hwc2Device::Display::clearReleaseFences() {
+    for (const auto& release : mReleaseFences) {
+        if (release.second >= 0) {
+            close(release.second);
+        }
+    }
+    mReleaseFences.clear();
 }
 
-bool Hwc2Device::hasLayer(hwc2_layer_t layer) const {
-    return mLayers.count(layer) > 0;
+// Scaling limits applied to every plane.  They are kept conservative so
+// that the HVS does not run out of bandwidth on large downscales.
+static constexpr float kMaxUpscale = 16.0f;
+static constexpr float kMaxDownscale = 4.0f;
+
+void Hwc2Device::Display::initPlanes() {
+    uint32_t count = 0;
+    const kms_plane* planes = mContext->get_planes(uint32_t(mId), &count);
+
+    mPlanes.clear();
+    mCursorPlane = -1;
+    for (uint32_t i = 0; i < count; i++) {
+        // the cursor plane is handed out separately, it comes last
+        if (planes[i].type == DRM_PLANE_TYPE_CURSOR) {
+            mCursorPlane = int(i);
+            mCursorFormats.assign(planes[i].formats,
+                                  planes[i].formats + planes[i].num_formats);
+            continue;
+        }
+        PlaneAssigner::Plane plane;
+        plane.id = planes[i].plane_id;
+        plane.primary = (i == 0);
+        plane.formats.assign(planes[i].formats, planes[i].formats + planes[i].num_formats);
+        plane.rotations = planes[i].rotations;
+        plane.maxUpscale = kMaxUpscale;
+        plane.maxDownscale = kMaxDownscale;
+        mPlanes.push_back(std::move(plane));
+    }
 }
 
-bool Hwc2Device::markLayerDirty(hwc2_layer_t layer, bool dirty) {
-    if (mLayers.count(layer) == 0) {
+template <typename Rect>
+bool Hwc2Device::sameRect(const Rect& a, const Rect& b) {
+    return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+// HAL transforms flip first and then rotate clockwise, DRM rotates counter
+// clockwise and then reflects.  A quarter turn is ROTATE_270 in DRM terms,
+// and a flip ahead of it becomes a reflection along the other axis after.
+uint64_t Hwc2Device::drmRotation(int32_t halTransform) {
+    bool rot90 = halTransform & HAL_TRANSFORM_ROT_90;
+    uint64_t rotation;
+
+    switch (halTransform & (HAL_TRANSFORM_FLIP_H | HAL_TRANSFORM_FLIP_V)) {
+        case HAL_TRANSFORM_FLIP_H:
+            rotation = rot90 ? DRM_MODE_ROTATE_270 | DRM_MODE_REFLECT_Y
+                             : DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X;
+            break;
+        case HAL_TRANSFORM_FLIP_V:
+            rotation = rot90 ? DRM_MODE_ROTATE_270 | DRM_MODE_REFLECT_X
+                             : DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y;
+            break;
+        case HAL_TRANSFORM_FLIP_H | HAL_TRANSFORM_FLIP_V:
+            rotation = rot90 ? DRM_MODE_ROTATE_90 : DRM_MODE_ROTATE_180;
+            break;
+        default:
+            rotation = rot90 ? DRM_MODE_ROTATE_270 : DRM_MODE_ROTATE_0;
+            break;
+    }
+
+    return rotation;
+}
+
+void Hwc2Device::closeFence(int32_t* fence) {
+    if (*fence >= 0) {
+        close(*fence);
+        *fence = -1;
+    }
+}
+
+kms_layer Hwc2Device::toKmsLayer(const LayerState& layer) {
+    const auto& crop = layer.sourceCrop;
+    const auto& frame = layer.displayFrame;
+    kms_layer out{};
+
+    out.handle = layer.buffer;
+    out.plane = uint32_t(layer.plane);
+    out.src_x = uint32_t(crop.left * 65536.0f);
+    out.src_y = uint32_t(crop.top * 65536.0f);
+    out.src_w = uint32_t((crop.right - crop.left) * 65536.0f);
+    out.src_h = uint32_t((crop.bottom - crop.top) * 65536.0f);
+    out.crtc_x = frame.left;
+    out.crtc_y = frame.top;
+    out.crtc_w = uint32_t(frame.right - frame.left);
+    out.crtc_h = uint32_t(frame.bottom - frame.top);
+    out.rotation = drmRotation(layer.transform);
+    out.acquire_fence = -1;
+
+    return out;
+}
+
+// The cursor plane takes unscaled, unrotated buffers up to the cursor size.
+// They may hang off the screen edges.
+bool Hwc2Device::Display::canUseCursorPlane(const LayerState& layer) const {
+    if (mCursorPlane < 0 || layer.compositionType != HWC2_COMPOSITION_CURSOR ||
+            !layer.buffer || layer.transform != 0 || layer.planeAlpha < 1.0f ||
+            layer.blendMode == HWC2_BLEND_MODE_COVERAGE) {
+        return false;
+    }
+    const auto& crop = layer.sourceCrop;
+    const auto& frame = layer.displayFrame;
+    int32_t width = frame.right - frame.left;
+    int32_t height = frame.bottom - frame.top;
+    uint32_t maxWidth, maxHeight;
+    mContext->cursor_size(&maxWidth, &maxHeight);
+    if (width <= 0 || height <= 0 || uint32_t(width) > maxWidth ||
+            uint32_t(height) > maxHeight ||
+            crop.right - crop.left != float(width) || crop.bottom - crop.top != float(height)) {
         return false;
     }
+    uint32_t format = mContext->buffer_format(layer.buffer);
+    return std::find(mCursorFormats.cbegin(), mCursorFormats.cend(), format) !=
+            mCursorFormats.cend();
+}
+
+// Moves a cursor layer without a new frame when it is on the cursor plane.
+// Otherwise the client has to composite it again.
+void Hwc2Device::Display::setCursorPosition(LayerState& layer, int32_t x, int32_t y) {
+    auto& frame = layer.displayFrame;
+    frame.right += x - frame.left;
+    frame.bottom += y - frame.top;
+    frame.left = x;
+    frame.top = y;
+
+    if (layer.plane >= 0 && layer.plane == mCursorPlane && layer.scanout) {
+        // on failure the next present puts the cursor at the new position
+        if (mContext->move_cursor(uint32_t(mId), x, y) == 0) {
+            mCursorMoves++;
+        }
+        return;
+    }
+    setLayerDirty(layer, kDirtyDisplayFrame);
+}
 
-    if (dirty) {
-        mDirtyLayers.insert(layer);
+// Decide the composition type of every layer for the next frame.  Layers
+// that fit on a plane become DEVICE, everything else is composited by the
+// client into the client target on the primary plane.  When no layer
+// changed its geometry since the last validation, the previous
+// assignment still holds and only new buffers were set.
+void Hwc2Device::Display::assignPlanes() {
+    bool geometryChanged = mGeometryChanged;
+    for (const auto& layer : mLayers) {
+        if ((layer.dirty & kDirtyGeometry) != 0) {
+            geometryChanged = true;
+            break;
+        }
+    }
+    mValidations++;
+    if (geometryChanged) {
+        mGeometryChanged = !assignAllPlanes();
     } else {
-        mDirtyLayers.erase(layer);
+        mIncrementalValidations++;
     }
+    mValidatedSincePresent = true;
 
-    return true;
+    mLayers.clearFlags();
+    for (size_t i = 0; i < mLayers.size(); i++) {
+        auto& layer = mLayers[i];
+        if (layer.plane < 0) {
+            layer.validatedType = HWC2_COMPOSITION_CLIENT;
+        } else if (layer.compositionType == HWC2_COMPOSITION_CURSOR) {
+            layer.validatedType = HWC2_COMPOSITION_CURSOR;
+        } else {
+            layer.validatedType = HWC2_COMPOSITION_DEVICE;
+        }
+        mLayers.setFlag(i, layer.validatedType != layer.compositionType);
+        layer.dirty = 0;
+    }
+    ATRACE_INT(mLayerCounter.c_str(), int32_t(mLayers.size()));
+    ATRACE_INT(mDeviceLayerCounter.c_str(), int32_t(mDeviceLayerCount));
 }
 
-const std::unordered_set<hwc2_layer_t>& Hwc2Device::getDirtyLayers() const {
-    return mDirtyLayers;
-}
+// Returns false when the kernel rejected the assignment, which may not
+// hold for the next frame either.
+bool Hwc2Device::Display::assignAllPlanes() {
+    std::vector<uint32_t> order(mLayers.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        const auto& la = mLayers[a];
+        const auto& lb = mLayers[b];
+        return la.z != lb.z ? la.z < lb.z : a < b;
+    });
+
+    // the cursor plane is above every other plane, so only the top layer
+    // can go there
+    bool onCursorPlane = !mClientColorTransform && !order.empty() &&
+                         canUseCursorPlane(mLayers[order.back()]);
+    uint32_t cursorLayer = onCursorPlane ? order.back() : 0;
+    if (onCursorPlane) {
+        order.pop_back();
+    }
 
-void Hwc2Device::clearDirtyLayers() {
-    mDirtyLayers.clear();
+    std::vector<PlaneAssigner::Layer> candidates;
+    candidates.reserve(order.size());
+    for (auto index : order) {
+        const auto& layer = mLayers[index];
+        const auto& crop = layer.sourceCrop;
+        const auto& frame = layer.displayFrame;
+        bool swapAxes = layer.transform & HAL_TRANSFORM_ROT_90;
+
+        PlaneAssigner::Layer candidate;
+        candidate.id = mLayers.idAt(index);
+        candidate.forceClient = (layer.compositionType != HWC2_COMPOSITION_DEVICE &&
+                                 layer.compositionType != HWC2_COMPOSITION_CURSOR) ||
+                                !layer.buffer || layer.planeAlpha < 1.0f ||
+                                mClientColorTransform ||
+                                layer.blendMode == HWC2_BLEND_MODE_COVERAGE;
+        candidate.format = layer.buffer ? mContext->buffer_format(layer.buffer) : 0;
+        candidate.rotation = drmRotation(layer.transform);
+        candidate.srcWidth = swapAxes ? crop.bottom - crop.top : crop.right - crop.left;
+        candidate.srcHeight = swapAxes ? crop.right - crop.left : crop.bottom - crop.top;
+        candidate.dstLeft = frame.left;
+        candidate.dstTop = frame.top;
+        candidate.dstRight = frame.right;
+        candidate.dstBottom = frame.bottom;
+        candidates.push_back(candidate);
+    }
+
+    auto result = PlaneAssigner::assign(mPlanes, candidates, int32_t(getInfo().width),
+                                        int32_t(getInfo().height));
+
+    // the kernel has the final word on bandwidth and plane limits
+    std::vector<kms_layer> layers;
+    for (size_t i = 0; i < order.size(); i++) {
+        auto& layer = mLayers[order[i]];
+        layer.plane = result.planeForLayer[i];
+        if (layer.plane >= 0) {
+            layers.push_back(toKmsLayer(layer));
+        }
+    }
+    if (onCursorPlane) {
+        auto& layer = mLayers[cursorLayer];
+        layer.plane = mCursorPlane;
+        layers.push_back(toKmsLayer(layer));
+    }
+    bool accepted = true;
+    if (!layers.empty() &&
+            mContext->hwc_check(uint32_t(mId), result.clientTarget ? mBuffer : nullptr,
+                                layers.data(), layers.size()) != 0) {
+        ALOGV("assignPlanes() %zu layers rejected, using client composition", layers.size());
+        for (auto& layer : mLayers) {
+            layer.plane = -1;
+        }
+        layers.clear();
+        result.clientTarget = true;
+        accepted = false;
+    }
+    mDeviceLayerCount = layers.size();
+    mClientTargetNeeded = result.clientTarget;
+
+    return accepted;
 }
 
 
@@ -314,13 +1465,36 @@ bool Hwc2Device::VsyncThread::sleepUntil(int64_t t) {
     }
 }
 
-void Hwc2Device::VsyncThread::start(int64_t firstVsync, int64_t period) {
+void Hwc2Device::VsyncThread::start(hwc2_display_t display, int64_t firstVsync,
+        int64_t period, hwc_context* context) {
+    mDisplay = display;
     mNextVsync = firstVsync;
     mPeriod = period;
+    mContext = context;
     mStarted = true;
     mThread = std::thread(&VsyncThread::vsyncLoop, this);
 }
 
+void Hwc2Device::VsyncThread::setPeriod(int64_t period) {
+    mPeriod = period;
+}
+
+void Hwc2Device::VsyncThread::setConnected(bool connected) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mConnected = connected;
+    }
+    mCondition.notify_all();
+}
+
+void Hwc2Device::VsyncThread::setPowered(bool powered) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPowered = powered;
+    }
+    mCondition.notify_all();
+}
+
 void Hwc2Device::VsyncThread::stop() {
     {
         std::lock_guard<std::mutex> lock(mMutex);
@@ -352,9 +1526,11 @@ void Hwc2Device::VsyncThread::vsyncLoop() {
         return;
     }
 
-    while (true) {
-        if (!mCallbackEnabled) {
-            mCondition.wait(lock, [this] { return mCallbackEnabled || !mStarted; });
+    while (mStarted) {
+        if (!isActive()) {
+            mCondition.wait(lock, [this] {
+                return isActive() || !mStarted;
+            });
             if (!mStarted) {
                 break;
             }
@@ -362,26 +1538,58 @@ void Hwc2Device::VsyncThread::vsyncLoop() {
 
         lock.unlock();
 
-        // adjust mNextVsync if necessary
-        int64_t t = now();
-        if (mNextVsync < t) {
-            int64_t n = (t - mNextVsync + mPeriod - 1) / mPeriod;
-            mNextVsync += mPeriod * n;
-        }
-        bool fire = sleepUntil(mNextVsync);
+        int64_t timestamp;
+        bool fire = waitForVsync(&timestamp);
 
         lock.lock();
 
         if (fire) {
-            ALOGV("VsyncThread(%" PRId64 ")", mNextVsync);
+            ALOGV("VsyncThread(%" PRIu64 ", %" PRId64 ")", mDisplay, timestamp);
             if (mCallback) {
-                mCallback(mCallbackData, 0, mNextVsync);
+                ATRACE_NAME("vsync callback");
+                mCallback(mCallbackData, mDisplay, timestamp);
+                if (mTimeline) {
+                    mTimeline->recordVsync(now());
+                }
             }
-            mNextVsync += mPeriod;
         }
     }
 }
 
+// Waits for the next vblank.  Kernel timestamps are used when available
+// and keep the software predictor in phase with the scanout, so that it
+// can take over without a jump while vblank events are unavailable, e.g.
+// with the crtc off.
+bool Hwc2Device::VsyncThread::waitForVsync(int64_t* outTimestamp) {
+    if (mContext && mPredictedFrames == 0) {
+        int64_t timestamp;
+        int err = mContext->wait_vblank(uint32_t(mDisplay), &timestamp);
+        if (err == 0) {
+            *outTimestamp = timestamp;
+            mNextVsync = timestamp + mPeriod;
+            return true;
+        }
+        ALOGV("wait_vblank failed (%d), predicting vsync", err);
+        mPredictedFrames = kPredictedFramesBeforeRetry;
+    }
+    if (mPredictedFrames > 0) {
+        mPredictedFrames--;
+    }
+
+    // adjust mNextVsync if necessary
+    int64_t t = now();
+    if (mNextVsync < t) {
+        int64_t n = (t - mNextVsync + mPeriod - 1) / mPeriod;
+        mNextVsync += mPeriod * n;
+    }
+    if (!sleepUntil(mNextVsync)) {
+        return false;
+    }
+    *outTimestamp = mNextVsync;
+    mNextVsync += mPeriod;
+    return true;
+}
+
 
 
 } // namespace android
@@ -8,15 +8,21 @@
 
 #include <ui/Fence.h>
 
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
-#include <unordered_set>
+#include <vector>
 
 #include <gralloc_drm.h>
 #include <gralloc_drm_priv.h>
 #include "hwc_context.h"
+#include "FrameTimeline.h"
+#include "PlaneAssigner.h"
+#include "SlotMap.h"
 
 namespace android {
 
@@ -24,6 +30,8 @@ class Hwc2Device {
 public:
     Hwc2Device();
 
+    void getCapabilities(uint32_t* outCount, int32_t* outCapabilities);
+
     int32_t createLayer(hwc2_display_t displayId, hwc2_layer_t* outLayerId);
     int32_t destroyLayer(hwc2_display_t displayId, hwc2_layer_t layerId);
     int32_t getClientTargetSupport(hwc2_display_t displayId, uint32_t width, uint32_t height,
@@ -31,29 +39,111 @@ public:
     int32_t getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t config,
             int32_t intAttribute, int32_t* outValue);
     int32_t getDisplayName(hwc2_display_t displayId, uint32_t* outSize, char* outName);
+    int32_t getDisplayType(hwc2_display_t displayId, int32_t* outType);
+    int32_t getDozeSupport(hwc2_display_t displayId, int32_t* outSupport);
+    int32_t getDisplayConfigs(hwc2_display_t displayId, uint32_t* outNumConfigs,
+            hwc2_config_t* outConfigs);
+    int32_t getActiveConfig(hwc2_display_t displayId, hwc2_config_t* outConfig);
+    int32_t setActiveConfig(hwc2_display_t displayId, hwc2_config_t config);
+    int32_t getColorModes(hwc2_display_t displayId, uint32_t* outNumModes, int32_t* outModes);
+    int32_t setColorMode(hwc2_display_t displayId, int32_t mode);
+    int32_t setColorTransform(hwc2_display_t displayId, const float* matrix, int32_t hint);
 
+    int32_t setPowerMode(hwc2_display_t displayId, int32_t intMode);
     int32_t setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled);
 
     int32_t setClientTarget(hwc2_display_t displayId, buffer_handle_t target,
             int32_t acquireFence, int32_t dataspace, hwc_region_t damage);
+    // not part of HWC2, called when a new buffer fills a client target slot
+    int32_t prepareClientTarget(hwc2_display_t displayId, buffer_handle_t target);
     int32_t validateDisplay(hwc2_display_t displayId, uint32_t* outNumTypes,
             uint32_t* outNumRequests);
     int32_t presentDisplay(hwc2_display_t displayId, int32_t* outRetireFence);
+    int32_t getReleaseFences(hwc2_display_t displayId, uint32_t* outNumElements,
+            hwc2_layer_t* outLayers, int32_t* outFences);
     int32_t acceptDisplayChanges(hwc2_display_t displayId);
 
     int32_t getChangedCompositionTypes(hwc2_display_t displayId, uint32_t* outNumElements,
             hwc2_layer_t* outLayers, int32_t* outTypes);
     int32_t setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
             int32_t intType);
+    int32_t setLayerBuffer(hwc2_display_t displayId, hwc2_layer_t layerId,
+            buffer_handle_t buffer, int32_t acquireFence);
+    int32_t setLayerDisplayFrame(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_rect_t frame);
+    int32_t setLayerSourceCrop(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_frect_t crop);
+    int32_t setCursorPosition(hwc2_display_t displayId, hwc2_layer_t layerId, int32_t x,
+            int32_t y);
+    int32_t setLayerTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+            int32_t intTransform);
+    int32_t setLayerZOrder(hwc2_display_t displayId, hwc2_layer_t layerId, uint32_t z);
+    int32_t setLayerBlendMode(hwc2_display_t displayId, hwc2_layer_t layerId,
+            int32_t intMode);
+    int32_t setLayerPlaneAlpha(hwc2_display_t displayId, hwc2_layer_t layerId, float alpha);
+    int32_t setLayerDataspace(hwc2_display_t displayId, hwc2_layer_t layerId,
+            int32_t dataspace);
+    int32_t setLayerVisibleRegion(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_region_t visible);
+    int32_t setLayerSurfaceDamage(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_region_t damage);
+    int32_t setLayerColor(hwc2_display_t displayId, hwc2_layer_t layerId, hwc_color_t color);
 
     void dump(uint32_t* outSize, char* outBuffer);
+    // not part of HWC2, called when a command batch arrives
+    void onCommandBatch();
 
     int32_t registerCallback(int32_t intDesc, hwc2_callback_data_t callbackData,
             hwc2_function_pointer_t pointer);
 
 private:
+    class VsyncThread {
+    public:
+        static int64_t now();
+        static bool sleepUntil(int64_t t);
+
+        // context, when non-null, provides kernel vblank timestamps
+        void start(hwc2_display_t display, int64_t first, int64_t period,
+                   hwc_context* context);
+        void stop();
+        void setPeriod(int64_t period);
+        // no vsync is delivered while the display is disconnected or off,
+        // the thread sleeps until it is back
+        void setConnected(bool connected);
+        void setPowered(bool powered);
+        void setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data);
+        void enableCallback(bool enable);
+        void setTimeline(FrameTimeline* timeline) { mTimeline = timeline; }
+
+    private:
+        void vsyncLoop();
+        bool waitUntilNextVsync();
+        bool waitForVsync(int64_t* outTimestamp);
+
+        std::thread mThread;
+        hwc2_display_t mDisplay{0};
+        int64_t mNextVsync{0};
+        std::atomic<int64_t> mPeriod{0};
+
+        // software vsyncs to predict before retrying vblank events
+        static constexpr int kPredictedFramesBeforeRetry = 60;
+        hwc_context* mContext{nullptr};
+        int mPredictedFrames{0};
+        FrameTimeline* mTimeline{nullptr};
+
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        bool mStarted{false};
+        HWC2_PFN_VSYNC mCallback{nullptr};
+        hwc2_callback_data_t mCallbackData{nullptr};
+        bool mCallbackEnabled{false};
+        bool mConnected{true};
+        bool mPowered{true};
+        bool isActive() const { return mCallbackEnabled && mConnected && mPowered; }
+    };
+
+    // attributes of a display config
     struct Info {
-        std::string name;
         uint32_t width;
         uint32_t height;
         int format;
@@ -61,61 +151,219 @@ private:
         int xdpi_scaled;
         int ydpi_scaled;
     };
-    Info mFbInfo{};
-    const Info& getInfo() const { return mFbInfo; }
 
     enum class State {
         MODIFIED,
         VALIDATED_WITH_CHANGES,
         VALIDATED,
     };
-    State mState{State::MODIFIED};
-    void setState(State state) { mState = state; }
-    State getState() const { return mState; }
-
-    uint64_t mNextLayerId{0};
-    std::unordered_set<hwc2_layer_t> mLayers;
-    std::unordered_set<hwc2_layer_t> mDirtyLayers;
-    hwc2_layer_t addLayer();
-    bool removeLayer(hwc2_layer_t layer);
-    bool hasLayer(hwc2_layer_t layer) const;
-    bool markLayerDirty(hwc2_layer_t layer, bool dirty);
-    const std::unordered_set<hwc2_layer_t>& getDirtyLayers() const;
-    void clearDirtyLayers();
 
-    buffer_handle_t mBuffer{nullptr};
+    // Dirty bits of the layer properties, set when the client changes a
+    // value and cleared by the next validation.
+    enum : uint32_t {
+        kDirtyCompositionType = 1 << 0,
+        kDirtyBuffer = 1 << 1,
+        kDirtyBufferFormat = 1 << 2,  // new buffer of another format, or none
+        kDirtyDisplayFrame = 1 << 3,
+        kDirtySourceCrop = 1 << 4,
+        kDirtyTransform = 1 << 5,
+        kDirtyZOrder = 1 << 6,
+        kDirtyBlendMode = 1 << 7,
+        kDirtyPlaneAlpha = 1 << 8,
+        kDirtyDataspace = 1 << 9,
+        kDirtyVisibleRegion = 1 << 10,
+        kDirtySurfaceDamage = 1 << 11,
+        kDirtyColor = 1 << 12,
+    };
+    // properties the plane assignment depends on
+    static constexpr uint32_t kDirtyGeometry = kDirtyCompositionType | kDirtyBufferFormat |
+            kDirtyDisplayFrame | kDirtySourceCrop | kDirtyTransform | kDirtyZOrder |
+            kDirtyBlendMode | kDirtyPlaneAlpha;
 
+    // State of a layer.  What validation and present read every frame
+    // comes first, the properties that are only stored come last.
+    struct LayerState {
+        buffer_handle_t buffer{nullptr};
+        uint32_t dirty{0};
+        int32_t compositionType{HWC2_COMPOSITION_INVALID};
+        int32_t validatedType{HWC2_COMPOSITION_INVALID};
+        int32_t plane{-1};
+        uint32_t z{0};
+        int32_t transform{0};
+        int32_t blendMode{HWC2_BLEND_MODE_NONE};
+        float planeAlpha{1.0f};
+        hwc_rect_t displayFrame{};
+        hwc_frect_t sourceCrop{};
+        buffer_handle_t scanout{nullptr};  // buffer on a plane since the last present
+        int32_t acquireFence{-1};          // of buffer, until the next present
 
-    std::string mDumpString;
+        int32_t dataspace{HAL_DATASPACE_UNKNOWN};
+        hwc_color_t color{};
+        hwc_rect_t visibleBounds{};  // bounds of the visible region
+        hwc_rect_t damageBounds{};   // bounds of the surface damage
+        uint32_t damageRects{0};
+    };
 
-    class VsyncThread {
+    // State of one connected display, driven by its own crtc in hwc_context.
+    class Display {
     public:
-        static int64_t now();
-        static bool sleepUntil(int64_t t);
+        Display(hwc2_display_t id, hwc_context* context);
+        ~Display();
 
-        void start(int64_t first, int64_t period);
-        void stop();
-        void setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data);
-        void enableCallback(bool enable);
+        hwc2_display_t getId() const { return mId; }
+        const std::string& getName() const { return mName; }
+        const Info& getInfo() const { return mConfigs[mActiveConfig]; }
+        const Info* getConfig(hwc2_config_t config) const;
+        uint32_t getConfigCount() const { return uint32_t(mConfigs.size()); }
+        hwc2_config_t getActiveConfig() const { return mActiveConfig; }
+        bool setActiveConfig(hwc2_config_t config);
+        bool isConnected() const { return mConnected; }
+        // a change beyond layer properties, the next validation starts over
+        void invalidate();
+        bool setPowerMode(int32_t mode);
+        void onHotplug(bool connected);
+        void setState(State state) { mState = state; }
+        State getState() const { return mState; }
+
+        hwc2_layer_t addLayer();
+        bool removeLayer(hwc2_layer_t layer);
+        LayerState* getLayer(hwc2_layer_t layer) { return mLayers.get(layer); }
+        void setLayerDirty(LayerState& layer, uint32_t dirty);
+        uint32_t getChangedTypeCount() const { return uint32_t(mLayers.flagCount()); }
+
+        void setClientTarget(buffer_handle_t target, int32_t acquireFence,
+                const hwc_region_t& damage);
+        void setLayerBuffer(LayerState& layer, buffer_handle_t buffer, int32_t acquireFence);
+        void setLayerRegion(LayerState& layer, const hwc_region_t& region, bool damage);
+        void assignPlanes();
+        void setCursorPosition(LayerState& layer, int32_t x, int32_t y);
+        void setColorTransform(const float* matrix, int32_t hint);
+        int present(int32_t* outPresentFence);
+        void acceptChanges();
+        void getChangedCompositionTypes(uint32_t* outNumElements, hwc2_layer_t* outLayers,
+                int32_t* outTypes);
+        void getReleaseFences(uint32_t* outNumElements, hwc2_layer_t* outLayers,
+                int32_t* outFences);
+
+        VsyncThread& getVsyncThread() { return mVsyncThread; }
+        // opens the timeline entry of the next frame, once per frame
+        void beginFrame(int64_t batch);
+        uint64_t getFrame() const { return mFrame; }
+        FrameTimeline& getTimeline() { return mTimeline; }
+        void dump(std::stringstream& output) const;
 
     private:
-        void vsyncLoop();
-        bool waitUntilNextVsync();
+        const hwc2_display_t mId;
+        hwc_context* const mContext;
+        std::string mName;
+        std::string mLayerCounter;        // trace counter names
+        std::string mDeviceLayerCounter;
+        std::vector<Info> mConfigs;  // one per connector mode
+        hwc2_config_t mActiveConfig{0};
+        // also read by registerCallback(), which cannot hold mStateMutex
+        std::atomic<bool> mConnected{false};
+        int32_t mPowerMode{HWC2_POWER_MODE_ON};
+        void loadConfigs();
+        State mState{State::MODIFIED};
 
-        std::thread mThread;
-        int64_t mNextVsync{0};
-        int64_t mPeriod{0};
+        // presents that reused the previous validation
+        bool mValidatedSincePresent{false};
+        uint64_t mPresentCount{0};
+        uint64_t mSkippedValidations{0};
 
-        std::mutex mMutex;
-        std::condition_variable mCondition;
-        bool mStarted{false};
-        HWC2_PFN_VSYNC mCallback{nullptr};
-        hwc2_callback_data_t mCallbackData{nullptr};
-        bool mCallbackEnabled{false};
+        // layer ids carry the display id as their tag, so they are unique
+        // across displays; a layer is flagged while validatedType differs
+        // from compositionType
+        SlotMap<LayerState> mLayers;
+        static constexpr size_t kLayerReserve = 64;
+
+        // validations that kept the previous plane assignment
+        bool mGeometryChanged{true};
+        uint64_t mValidations{0};
+        uint64_t mIncrementalValidations{0};
+
+        buffer_handle_t mBuffer{nullptr};
+        int32_t mBufferFence{-1};  // acquire fence of mBuffer, until the next present
+
+        // client target damage, forwarded to the primary plane
+        kms_damage mClientTargetDamage{};
+        bool mClientTargetOnScreen{false};
+        uint64_t mDamageFrames{0};
+        uint64_t mFullDamageFrames{0};
+        uint64_t mDamagedPixels{0};
+        void setClientTargetDamage(const hwc_region_t& damage);
+        void recordClientTargetDamage();
+
+        std::vector<std::pair<hwc2_layer_t, int32_t>> mReleaseFences;
+        void collectReleaseFences(int32_t presentFence);
+        void clearReleaseFences();
+
+        // overlay plane assignment
+        std::vector<PlaneAssigner::Plane> mPlanes;
+        bool mClientTargetNeeded{true};
+        uint32_t mDeviceLayerCount{0};
+        std::vector<kms_layer> mKmsLayers;  // scratch of present()
+        void initPlanes();
+        bool assignAllPlanes();
+
+        // cursor plane, the top layer goes there when it fits
+        int mCursorPlane{-1};
+        std::vector<uint32_t> mCursorFormats;
+        uint64_t mCursorMoves{0};
+        bool canUseCursorPlane(const LayerState& layer) const;
+
+        // a colour transform the crtc does not apply is left to the client,
+        // which then composites every layer
+        int32_t mColorTransformHint{HAL_COLOR_TRANSFORM_IDENTITY};
+        bool mClientColorTransform{false};
+
+        // frames are numbered by present, mFrame is the next one
+        FrameTimeline mTimeline;
+        uint64_t mFrame{1};
+        bool mFrameOpen{false};
+
+        VsyncThread mVsyncThread;
     };
-    VsyncThread mVsyncThread;
 
+    // declared ahead of the displays, whose vsync threads use it
     std::unique_ptr<hwc_context> mHwcContext;
+
+    std::vector<std::unique_ptr<Display>> mDisplays;
+    Display* getDisplay(hwc2_display_t displayId);
+    // The hotplug thread reloads the configs and resets the state of a
+    // display while the client drives it from binder and command threads.
+    // Every display entry point holds this lock, the flip and vsync
+    // callbacks only touch what is safe without it.
+    std::mutex mStateMutex;
+
+    std::mutex mHotplugMutex;
+    HWC2_PFN_HOTPLUG mHotplugCallback{nullptr};
+    hwc2_callback_data_t mHotplugCallbackData{nullptr};
+    static void hotplugHook(void* data, uint32_t display, int connected);
+    void onHotplug(hwc2_display_t displayId, bool connected);
+    static void flipHook(void* data, uint32_t display, uint64_t frame, int64_t timestamp,
+                         int done);
+
+    // arrival of the last command batch, the start of the frames it carries
+    std::atomic<int64_t> mLastBatch{0};
+
+    static uint64_t drmRotation(int32_t halTransform);
+    template <typename Rect>
+    static bool sameRect(const Rect& a, const Rect& b);
+    static kms_layer toKmsLayer(const LayerState& layer);
+    static void closeFence(int32_t* fence);
+
+    // presentDisplay() durations, bucket i counts calls shorter than
+    // kPresentBucketUs << i, the last bucket everything longer
+    static constexpr int64_t kPresentBucketUs = 16;
+    static constexpr size_t kPresentBuckets = 12;
+    uint64_t mPresentHistogram[kPresentBuckets]{};
+    void recordPresentTime(int64_t ns);
+    void dumpPresentHistogram(std::stringstream& output) const;
+
+    std::string mDumpString;
+    static void dumpCommitStats(std::stringstream& output, const char* name,
+            const commit_stats& stats);
 };
 
 } // namespace android
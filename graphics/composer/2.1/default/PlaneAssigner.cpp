@@ -0,0 +1,97 @@
+#define LOG_TAG "composer@2.1-PlaneAssigner"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+
+#include <algorithm>
+
+#include "PlaneAssigner.h"
+
+namespace android {
+
+bool PlaneAssigner::canScanout(const Plane& plane, const Layer& layer, int32_t displayWidth,
+                               int32_t displayHeight) {
+    if (layer.forceClient || layer.format == 0) {
+        return false;
+    }
+    if (std::find(plane.formats.cbegin(), plane.formats.cend(), layer.format) ==
+            plane.formats.cend()) {
+        return false;
+    }
+    if ((layer.rotation & ~plane.rotations) != 0) {
+        return false;
+    }
+
+    // planes are not clipped, the frame has to be fully on screen
+    if (layer.dstLeft < 0 || layer.dstTop < 0 ||
+            layer.dstRight > displayWidth || layer.dstBottom > displayHeight ||
+            layer.dstRight <= layer.dstLeft || layer.dstBottom <= layer.dstTop) {
+        return false;
+    }
+    if (layer.srcWidth <= 0.0f || layer.srcHeight <= 0.0f) {
+        return false;
+    }
+
+    float scaleX = float(layer.dstRight - layer.dstLeft) / layer.srcWidth;
+    float scaleY = float(layer.dstBottom - layer.dstTop) / layer.srcHeight;
+    if (scaleX > plane.maxUpscale || scaleY > plane.maxUpscale) {
+        return false;
+    }
+    if (scaleX * plane.maxDownscale < 1.0f || scaleY * plane.maxDownscale < 1.0f) {
+        return false;
+    }
+
+    return true;
+}
+
+PlaneAssigner::Result PlaneAssigner::assign(const std::vector<Plane>& planes,
+                                            const std::vector<Layer>& layers,
+                                            int32_t displayWidth, int32_t displayHeight) {
+    Result result;
+    result.planeForLayer.assign(layers.size(), -1);
+    result.clientTarget = true;
+
+    if (planes.empty() || !planes.front().primary || layers.empty()) {
+        return result;
+    }
+
+    // Walk the layers top-down and stack them on overlays.  Overlays are
+    // blended in plane order, so each layer has to land on a lower plane
+    // than the one above it.  The first layer that does not fit ends the
+    // walk: it and everything below it go into the client target.
+    int nextPlane = int(planes.size()) - 1;
+    size_t firstDevice = layers.size();
+    while (firstDevice > 0 && nextPlane > 0) {
+        const Layer& layer = layers[firstDevice - 1];
+        int plane = nextPlane;
+        while (plane > 0 && !canScanout(planes[plane], layer, displayWidth, displayHeight)) {
+            plane--;
+        }
+        if (plane == 0) {
+            break;
+        }
+        result.planeForLayer[firstDevice - 1] = plane;
+        nextPlane = plane - 1;
+        firstDevice--;
+    }
+
+    // The primary plane always scans out something.  When the bottom
+    // layer is the only one left for the client target, or every layer
+    // found an overlay, put the bottom layer on the primary plane instead
+    // of compositing a client target.
+    if (firstDevice <= 1 && canScanout(planes.front(), layers.front(), displayWidth,
+                                       displayHeight)) {
+        result.planeForLayer.front() = 0;
+        firstDevice = 0;
+    } else if (firstDevice == 0) {
+        result.planeForLayer.front() = -1;
+        firstDevice = 1;
+    }
+    result.clientTarget = firstDevice > 0;
+
+    ALOGV("assign() %zu layers, %zu on planes, client target %d", layers.size(),
+          layers.size() - firstDevice, result.clientTarget);
+
+    return result;
+}
+
+} // namespace android
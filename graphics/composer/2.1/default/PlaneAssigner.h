@@ -0,0 +1,55 @@
+#ifndef _PLANE_ASSIGNER_H_
+#define _PLANE_ASSIGNER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace android {
+
+// Decides which layers of a frame can be scanned out directly on a
+// hardware plane.  It only sees plain descriptions of planes and layers,
+// so it has no DRM or gralloc dependency and can be driven by a mock
+// plane list.
+class PlaneAssigner {
+public:
+    struct Plane {
+        uint32_t id;
+        bool primary;
+        std::vector<uint32_t> formats;  // DRM fourcc codes
+        uint64_t rotations;             // supported DRM_MODE_ROTATE_* / REFLECT_* bits
+        float maxUpscale;               // 1.0f when the plane cannot scale
+        float maxDownscale;
+    };
+
+    struct Layer {
+        uint64_t id;
+        bool forceClient;  // client composition requested or required
+        uint32_t format;   // DRM fourcc code, 0 when unknown
+        uint64_t rotation; // one DRM_MODE_ROTATE_* bit, optionally REFLECT_* bits
+        float srcWidth;
+        float srcHeight;
+        int32_t dstLeft;
+        int32_t dstTop;
+        int32_t dstRight;
+        int32_t dstBottom;
+    };
+
+    struct Result {
+        // layer index -> plane index, -1 for client composition
+        std::vector<int> planeForLayer;
+        bool clientTarget;
+    };
+
+    // planes are ordered bottom to top with the primary plane first,
+    // layers are ordered by ascending z.
+    static Result assign(const std::vector<Plane>& planes, const std::vector<Layer>& layers,
+                         int32_t displayWidth, int32_t displayHeight);
+
+    static bool canScanout(const Plane& plane, const Layer& layer, int32_t displayWidth,
+                           int32_t displayHeight);
+};
+
+} // namespace android
+
+#endif // _PLANE_ASSIGNER_H_
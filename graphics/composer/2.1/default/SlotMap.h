@@ -0,0 +1,171 @@
+#ifndef _SLOT_MAP_H_
+#define _SLOT_MAP_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace android {
+
+// Values addressed by stable 64-bit ids and stored packed in a vector.
+// An id holds the index of its slot in the low 32 bits, the generation of
+// the slot in the next 24 bits and the tag of the map in the top 8 bits,
+// so ids of maps with different tags never collide and a stale id stops
+// resolving once its slot is reused.  Values keep their insertion order
+// until a removal moves the last value into the hole.
+//
+// Lookup, insertion and removal are O(1) and do not allocate once the
+// map has grown to its peak size.  Each value has a flag, kept in a bitset
+// that follows the value when it moves.
+template <typename T>
+class SlotMap {
+public:
+    using Id = uint64_t;
+
+    explicit SlotMap(uint8_t tag = 0) : mTag(tag) {}
+
+    void reserve(size_t count) {
+        mSlots.reserve(count);
+        mValues.reserve(count);
+        mValueSlots.reserve(count);
+        mFlags.reserve((count + 63) / 64);
+    }
+
+    Id insert(const T& value) {
+        uint32_t slot;
+        if (mFreeSlot != kNoSlot) {
+            slot = mFreeSlot;
+            mFreeSlot = mSlots[slot].index;
+        } else {
+            slot = uint32_t(mSlots.size());
+            mSlots.push_back(Slot{0, 0});
+        }
+        // generations start at 1 so that no id is 0
+        mSlots[slot].generation = (mSlots[slot].generation + 1) & kGenerationMask;
+        if (mSlots[slot].generation == 0) {
+            mSlots[slot].generation = 1;
+        }
+        mSlots[slot].index = uint32_t(mValues.size());
+
+        mValues.push_back(value);
+        mValueSlots.push_back(slot);
+        if (mFlags.size() * 64 < mValues.size()) {
+            mFlags.push_back(0);
+        }
+        setFlag(mValues.size() - 1, false);
+
+        return makeId(slot);
+    }
+
+    bool erase(Id id) {
+        uint32_t slot;
+        if (!resolve(id, &slot)) {
+            return false;
+        }
+        uint32_t index = mSlots[slot].index;
+        uint32_t last = uint32_t(mValues.size()) - 1;
+        setFlag(index, false);
+        if (index != last) {
+            mValues[index] = mValues[last];
+            mValueSlots[index] = mValueSlots[last];
+            mSlots[mValueSlots[index]].index = index;
+            setFlag(index, getFlag(last));
+            setFlag(last, false);
+        }
+        mValues.pop_back();
+        mValueSlots.pop_back();
+
+        mSlots[slot].index = mFreeSlot;
+        mFreeSlot = slot;
+        return true;
+    }
+
+    T* get(Id id) {
+        uint32_t slot;
+        return resolve(id, &slot) ? &mValues[mSlots[slot].index] : nullptr;
+    }
+
+    size_t size() const { return mValues.size(); }
+    bool empty() const { return mValues.empty(); }
+
+    // values by position, 0 to size() - 1
+    T& operator[](size_t i) { return mValues[i]; }
+    const T& operator[](size_t i) const { return mValues[i]; }
+    Id idAt(size_t i) const { return makeId(mValueSlots[i]); }
+
+    typename std::vector<T>::iterator begin() { return mValues.begin(); }
+    typename std::vector<T>::iterator end() { return mValues.end(); }
+    typename std::vector<T>::const_iterator begin() const { return mValues.cbegin(); }
+    typename std::vector<T>::const_iterator end() const { return mValues.cend(); }
+
+    // flags by position
+    bool getFlag(size_t i) const { return (mFlags[i / 64] >> (i % 64)) & 1; }
+    void setFlag(size_t i, bool flag) {
+        uint64_t bit = uint64_t(1) << (i % 64);
+        if (flag != getFlag(i)) {
+            mFlags[i / 64] ^= bit;
+            mFlagCount += flag ? 1 : -1;
+        }
+    }
+    size_t flagCount() const { return mFlagCount; }
+    void clearFlags() {
+        for (auto& word : mFlags) {
+            word = 0;
+        }
+        mFlagCount = 0;
+    }
+
+    // position of the next flagged value at or after i, size() when none
+    size_t nextFlag(size_t i) const {
+        while (i < mValues.size()) {
+            uint64_t word = mFlags[i / 64] >> (i % 64);
+            if (word != 0) {
+                i += __builtin_ctzll(word);
+                return i < mValues.size() ? i : mValues.size();
+            }
+            i = (i / 64 + 1) * 64;
+        }
+        return mValues.size();
+    }
+
+private:
+    static constexpr uint32_t kNoSlot = UINT32_MAX;
+    static constexpr uint32_t kGenerationMask = (1u << 24) - 1;
+
+    struct Slot {
+        uint32_t generation;
+        uint32_t index;  // position of the value, or the next free slot
+    };
+
+    Id makeId(uint32_t slot) const {
+        return (Id(mTag) << 56) | (Id(mSlots[slot].generation) << 32) | slot;
+    }
+
+    bool resolve(Id id, uint32_t* outSlot) const {
+        uint32_t slot = uint32_t(id);
+        if ((id >> 56) != mTag || slot >= mSlots.size() ||
+                mSlots[slot].generation != ((id >> 32) & kGenerationMask)) {
+            return false;
+        }
+        // a free slot keeps its generation until it is reused, so a stale
+        // id still matches it; free slots are not below the value count
+        uint32_t index = mSlots[slot].index;
+        if (index >= mValues.size() || mValueSlots[index] != slot) {
+            return false;
+        }
+        *outSlot = slot;
+        return true;
+    }
+
+    const uint8_t mTag;
+    std::vector<Slot> mSlots;
+    std::vector<T> mValues;
+    std::vector<uint32_t> mValueSlots;  // slot of each value
+    std::vector<uint64_t> mFlags;
+    size_t mFlagCount{0};
+    uint32_t mFreeSlot{kNoSlot};
+};
+
+} // namespace android
+
+#endif // _SLOT_MAP_H_
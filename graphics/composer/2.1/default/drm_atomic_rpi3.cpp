@@ -0,0 +1,640 @@
+#define LOG_TAG "composer@2.1-drm_atomic_rpi3"
+//#define LOG_NDEBUG 0
+
+#include <cutils/properties.h>
+#include <utils/Log.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "hwc_context.h"
+
+namespace android {
+
+/*
+ * Look up a property on a KMS object by name.  Returns the property id,
+ * or 0 when the object does not have it.
+ */
+static uint32_t get_prop(int fd, uint32_t obj_id, uint32_t obj_type,
+		const char *name, uint64_t *value)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t id = 0;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !id; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name)) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	return id;
+}
+
+/*
+ * Collect the rotations a plane supports from its bitmask "rotation"
+ * property.  Planes without the property can only scan out unrotated.
+ */
+static uint64_t get_rotations(int fd, uint32_t prop_id)
+{
+	drmModePropertyPtr prop;
+	uint64_t rotations = 0;
+	int i;
+
+	if (!prop_id)
+		return DRM_MODE_ROTATE_0;
+
+	prop = drmModeGetProperty(fd, prop_id);
+	if (!prop)
+		return DRM_MODE_ROTATE_0;
+
+	for (i = 0; i < prop->count_enums; i++)
+		rotations |= 1ULL << prop->enums[i].value;
+	drmModeFreeProperty(prop);
+
+	return rotations;
+}
+
+static int init_plane(int fd, drmModePlanePtr p, uint32_t type,
+		struct kms_plane *plane)
+{
+	uint32_t id = p->plane_id;
+	uint32_t i;
+
+	memset(plane, 0, sizeof(*plane));
+	plane->plane_id = id;
+	plane->type = type;
+
+	plane->num_formats = p->count_formats;
+	if (plane->num_formats > KMS_MAX_FORMATS) {
+		ALOGW("plane %d: ignoring %d formats", id,
+			plane->num_formats - KMS_MAX_FORMATS);
+		plane->num_formats = KMS_MAX_FORMATS;
+	}
+	for (i = 0; i < plane->num_formats; i++)
+		plane->formats[i] = p->formats[i];
+
+	plane->prop.fb_id = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "FB_ID", NULL);
+	plane->prop.crtc_id = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", NULL);
+	plane->prop.src_x = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_X", NULL);
+	plane->prop.src_y = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_Y", NULL);
+	plane->prop.src_w = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_W", NULL);
+	plane->prop.src_h = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_H", NULL);
+	plane->prop.crtc_x = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_X", NULL);
+	plane->prop.crtc_y = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", NULL);
+	plane->prop.crtc_w = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_W", NULL);
+	plane->prop.crtc_h = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_H", NULL);
+	plane->prop.rotation = get_prop(fd, id, DRM_MODE_OBJECT_PLANE, "rotation", NULL);
+	plane->rotations = get_rotations(fd, plane->prop.rotation);
+	plane->prop.fb_damage_clips = get_prop(fd, id, DRM_MODE_OBJECT_PLANE,
+			"FB_DAMAGE_CLIPS", NULL);
+	plane->prop.in_fence_fd = get_prop(fd, id, DRM_MODE_OBJECT_PLANE,
+			"IN_FENCE_FD", NULL);
+
+	if (!plane->prop.fb_id || !plane->prop.crtc_id ||
+	    !plane->prop.src_x || !plane->prop.src_y ||
+	    !plane->prop.src_w || !plane->prop.src_h ||
+	    !plane->prop.crtc_x || !plane->prop.crtc_y ||
+	    !plane->prop.crtc_w || !plane->prop.crtc_h)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Hand out the planes among the outputs.  Each output gets the primary
+ * plane of its crtc.  Overlays usable by several crtcs go to the output
+ * with the fewest planes so far, which splits them evenly.  Overlays keep
+ * the order the driver lists them in, which is also their stacking order.
+ * The cursor plane of a crtc goes last, above the overlays; a slot is
+ * kept free for it.
+ */
+static int find_planes(int fd, struct kms_output *outputs, uint32_t count)
+{
+	struct kms_plane cursors[KMS_MAX_OUTPUTS];
+	drmModePlaneResPtr plane_res;
+	uint32_t i, j;
+
+	plane_res = drmModeGetPlaneResources(fd);
+	if (!plane_res)
+		return -ENODEV;
+
+	memset(cursors, 0, sizeof(cursors));
+	for (j = 0; j < count; j++) {
+		outputs[j].num_planes = 1;
+		outputs[j].planes[0].plane_id = 0;
+		outputs[j].cursor_plane = 0;
+	}
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(fd, plane_res->planes[i]);
+		struct kms_output *output = NULL;
+		struct kms_plane *dst = NULL;
+		uint64_t type = 0;
+
+		if (!plane)
+			continue;
+
+		if (!get_prop(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		for (j = 0; j < count; j++) {
+			struct kms_output *o = &outputs[j];
+
+			if (!(plane->possible_crtcs & (1 << o->pipe)))
+				continue;
+			if (type == DRM_PLANE_TYPE_PRIMARY && !o->planes[0].plane_id) {
+				output = o;
+				break;
+			}
+			if (type == DRM_PLANE_TYPE_CURSOR && !cursors[j].plane_id) {
+				if (init_plane(fd, plane, type, &cursors[j]))
+					cursors[j].plane_id = 0;
+				break;
+			}
+			if (type == DRM_PLANE_TYPE_OVERLAY &&
+			    o->num_planes < KMS_MAX_PLANES - 1 &&
+			    (!output || o->num_planes < output->num_planes))
+				output = o;
+		}
+
+		if (output && type != DRM_PLANE_TYPE_CURSOR) {
+			if (type == DRM_PLANE_TYPE_PRIMARY)
+				dst = &output->planes[0];
+			else
+				dst = &output->planes[output->num_planes];
+
+			if (init_plane(fd, plane, type, dst)) {
+				ALOGW("plane %d lacks atomic properties", plane->plane_id);
+				dst->plane_id = 0;
+			} else if (dst != &output->planes[0]) {
+				output->num_planes++;
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(plane_res);
+
+	for (j = 0; j < count; j++) {
+		struct kms_output *o = &outputs[j];
+
+		if (!o->planes[0].plane_id)
+			return -ENODEV;
+		if (cursors[j].plane_id) {
+			o->cursor_plane = o->num_planes;
+			o->planes[o->num_planes++] = cursors[j];
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Switch the device fd to atomic modesetting and resolve the properties
+ * needed to drive the outputs.  On failure the legacy path keeps being
+ * used for all of them.
+ */
+int hwc_context::init_atomic()
+{
+	char value[PROPERTY_VALUE_MAX];
+	uint32_t i;
+	int ret;
+
+	property_get("debug.drm.atomic", value, "1");
+	if (!atoi(value)) {
+		ALOGI("atomic modesetting disabled by debug.drm.atomic");
+		return -EPERM;
+	}
+
+	if (drmSetClientCap(kms_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+	    drmSetClientCap(kms_fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		ALOGI("driver does not support atomic modesetting");
+		return -EOPNOTSUPP;
+	}
+
+	ret = find_planes(kms_fd, outputs, num_outputs);
+	if (ret) {
+		ALOGE("failed to find a usable primary plane for every crtc");
+		return ret;
+	}
+
+	for (i = 0; i < num_outputs; i++) {
+		ret = init_output_atomic(&outputs[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int hwc_context::init_output_atomic(struct kms_output *output)
+{
+	int ret;
+
+	output->crtc_prop.active = get_prop(kms_fd, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "ACTIVE", NULL);
+	output->crtc_prop.mode_id = get_prop(kms_fd, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "MODE_ID", NULL);
+	output->crtc_prop.out_fence_ptr = get_prop(kms_fd, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR", NULL);
+	output->conn_prop.crtc_id = get_prop(kms_fd, output->connector_id,
+			DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", NULL);
+	/* colour management is optional */
+	output->crtc_prop.ctm = get_prop(kms_fd, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "CTM", NULL);
+	output->crtc_prop.gamma_lut = get_prop(kms_fd, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "GAMMA_LUT", NULL);
+	if (output->crtc_prop.gamma_lut) {
+		uint64_t size = 0;
+
+		get_prop(kms_fd, output->crtc_id, DRM_MODE_OBJECT_CRTC,
+				"GAMMA_LUT_SIZE", &size);
+		output->gamma_lut_size = size;
+	}
+	if (!output->crtc_prop.active || !output->crtc_prop.mode_id ||
+	    !output->conn_prop.crtc_id) {
+		ALOGE("crtc %d / connector %d lack atomic properties",
+			output->crtc_id, output->connector_id);
+		return -EINVAL;
+	}
+
+	ret = drmModeCreatePropertyBlob(kms_fd, &output->mode,
+			sizeof(output->mode), &output->mode_blob_id);
+	if (ret) {
+		ALOGE("failed to create mode blob (%s)", strerror(-ret));
+		return ret;
+	}
+
+	ALOGI("atomic modesetting on crtc %d, primary plane %d, %d overlays, %s",
+		output->crtc_id, output->planes[0].plane_id,
+		output->num_planes - 1 - !!output->cursor_plane,
+		output->cursor_plane ? "cursor plane" : "no cursor plane");
+
+	return 0;
+}
+
+static int add_plane(drmModeAtomicReqPtr req, struct kms_output *output,
+		struct kms_plane *plane, const struct kms_layer *layer,
+		uint32_t damage_blob)
+{
+	uint32_t id = plane->plane_id;
+	int ret = 0;
+
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.fb_id,
+			layer->bo->fb_id) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.crtc_id,
+			output->crtc_id) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.src_x, layer->src_x) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.src_y, layer->src_y) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.src_w, layer->src_w) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.src_h, layer->src_h) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.crtc_x, layer->crtc_x) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.crtc_y, layer->crtc_y) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.crtc_w, layer->crtc_w) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, plane->prop.crtc_h, layer->crtc_h) < 0;
+	if (plane->prop.rotation)
+		ret |= drmModeAtomicAddProperty(req, id, plane->prop.rotation,
+				layer->rotation) < 0;
+	/* the property is not latched, it has to be set on every commit */
+	if (plane->prop.fb_damage_clips)
+		ret |= drmModeAtomicAddProperty(req, id,
+				plane->prop.fb_damage_clips, damage_blob) < 0;
+	/* the kernel holds the flip until the buffer is ready */
+	if (plane->prop.in_fence_fd && layer->acquire_fence >= 0)
+		ret |= drmModeAtomicAddProperty(req, id,
+				plane->prop.in_fence_fd, layer->acquire_fence) < 0;
+
+	return ret ? -ENOMEM : 0;
+}
+
+static int disable_plane(drmModeAtomicReqPtr req, struct kms_plane *plane)
+{
+	int ret = 0;
+
+	ret |= drmModeAtomicAddProperty(req, plane->plane_id,
+			plane->prop.fb_id, 0) < 0;
+	ret |= drmModeAtomicAddProperty(req, plane->plane_id,
+			plane->prop.crtc_id, 0) < 0;
+
+	return ret ? -ENOMEM : 0;
+}
+
+/*
+ * Put the layers of a frame on their planes.  layers is indexed by plane,
+ * planes without a bo are switched off.  damage_blobs, when given, holds
+ * the FB_DAMAGE_CLIPS blob of each plane, 0 for full damage.
+ */
+static int add_planes(drmModeAtomicReqPtr req, struct kms_output *output,
+		const struct kms_layer *layers, const uint32_t *damage_blobs)
+{
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; i < output->num_planes && !ret; i++) {
+		if (layers[i].bo)
+			ret = add_plane(req, output, &output->planes[i], &layers[i],
+					damage_blobs ? damage_blobs[i] : 0);
+		else if (i)
+			ret = disable_plane(req, &output->planes[i]);
+		else
+			ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+static int add_color(drmModeAtomicReqPtr req, struct kms_output *output,
+		uint32_t ctm_blob_id, uint32_t gamma_blob_id)
+{
+	int ret = 0;
+
+	if (output->crtc_prop.ctm)
+		ret |= drmModeAtomicAddProperty(req, output->crtc_id,
+				output->crtc_prop.ctm, ctm_blob_id) < 0;
+	if (output->crtc_prop.gamma_lut)
+		ret |= drmModeAtomicAddProperty(req, output->crtc_id,
+				output->crtc_prop.gamma_lut, gamma_blob_id) < 0;
+
+	return ret ? -ENOMEM : 0;
+}
+
+/*
+ * Add a pending colour transform to a commit.
+ */
+static int add_pending_color(drmModeAtomicReqPtr req, struct kms_output *output)
+{
+	if (!output->color_dirty)
+		return 0;
+
+	return add_color(req, output, output->ctm_blob_id, output->gamma_blob_id);
+}
+
+/*
+ * The kernel holds its own reference to the blobs of a committed colour
+ * transform.
+ */
+static void color_committed(int fd, struct kms_output *output)
+{
+	if (!output->color_dirty)
+		return;
+
+	if (output->ctm_blob_id)
+		drmModeDestroyPropertyBlob(fd, output->ctm_blob_id);
+	if (output->gamma_blob_id)
+		drmModeDestroyPropertyBlob(fd, output->gamma_blob_id);
+	output->ctm_blob_id = 0;
+	output->gamma_blob_id = 0;
+	output->color_dirty = 0;
+}
+
+static int add_modeset(drmModeAtomicReqPtr req, struct kms_output *output)
+{
+	int ret = 0;
+
+	ret |= drmModeAtomicAddProperty(req, output->crtc_id,
+			output->crtc_prop.active, 1) < 0;
+	ret |= drmModeAtomicAddProperty(req, output->crtc_id,
+			output->crtc_prop.mode_id, output->mode_blob_id) < 0;
+	ret |= drmModeAtomicAddProperty(req, output->connector_id,
+			output->conn_prop.crtc_id, output->crtc_id) < 0;
+
+	return ret ? -ENOMEM : 0;
+}
+
+/*
+ * Bring up the output with a frame.  The crtc may already be running the
+ * mode (left over by the bootloader or a previous composer instance), in
+ * which case a TEST_ONLY commit without ALLOW_MODESET passes and the full
+ * modeset is skipped.  Blocks until the commit is done.
+ */
+int hwc_context::atomic_modeset(struct kms_output *output,
+		const struct kms_layer *layers)
+{
+	drmModeAtomicReqPtr req;
+	uint32_t flags = 0;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	ret = add_modeset(req, output);
+	if (!ret)
+		ret = add_planes(req, output, layers, NULL);
+	if (!ret)
+		ret = add_pending_color(req, output);
+	if (ret)
+		goto out;
+
+	if (drmModeAtomicCommit(kms_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL)) {
+		flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+		ret = drmModeAtomicCommit(kms_fd, req,
+				DRM_MODE_ATOMIC_TEST_ONLY | flags, NULL);
+		if (ret) {
+			ALOGE("atomic modeset rejected (%s) (crtc %d, fb %d, mode %dx%d)",
+				strerror(errno), output->crtc_id, layers[0].bo->fb_id,
+				output->mode.hdisplay, output->mode.vdisplay);
+			goto out;
+		}
+	}
+
+	ret = drmModeAtomicCommit(kms_fd, req, flags, NULL);
+	if (ret) {
+		ALOGE("atomic modeset failed (%s)", strerror(errno));
+		goto out;
+	}
+
+	color_committed(kms_fd, output);
+	ALOGI("atomic modeset done%s",
+		flags ? "" : " (mode already set, no full modeset)");
+
+out:
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+/*
+ * Switch a running output to another mode.  The fb on the primary plane
+ * is kept and stretched over the new mode until the next frame, overlays
+ * are turned off as their frames were placed for the old mode.  Blocks
+ * until the commit is done.
+ */
+int hwc_context::atomic_set_mode(struct kms_output *output,
+		const drmModeModeInfo *mode)
+{
+	struct kms_layer layers[KMS_MAX_PLANES];
+	struct gralloc_drm_bo_t *bo = output->current_front;
+	uint32_t old_blob_id = output->mode_blob_id;
+	drmModeAtomicReqPtr req;
+	uint32_t i;
+	int ret;
+
+	ret = drmModeCreatePropertyBlob(kms_fd, mode, sizeof(*mode),
+			&output->mode_blob_id);
+	if (ret) {
+		ALOGE("failed to create mode blob (%s)", strerror(-ret));
+		output->mode_blob_id = old_blob_id;
+		return ret;
+	}
+
+	memset(layers, 0, sizeof(layers));
+	for (i = 0; i < KMS_MAX_PLANES; i++)
+		layers[i].acquire_fence = -1;
+	layers[0].bo = bo;
+	layers[0].src_w = (uint32_t) bo->handle->width << 16;
+	layers[0].src_h = (uint32_t) bo->handle->height << 16;
+	layers[0].crtc_w = mode->hdisplay;
+	layers[0].crtc_h = mode->vdisplay;
+	layers[0].rotation = DRM_MODE_ROTATE_0;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = add_modeset(req, output);
+	if (!ret)
+		ret = add_planes(req, output, layers, NULL);
+	if (!ret) {
+		ret = drmModeAtomicCommit(kms_fd, req,
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		if (ret)
+			ALOGE("atomic mode switch to %s failed (%s)",
+				mode->name, strerror(errno));
+	}
+	drmModeAtomicFree(req);
+
+out:
+	if (ret) {
+		drmModeDestroyPropertyBlob(kms_fd, output->mode_blob_id);
+		output->mode_blob_id = old_blob_id;
+	} else {
+		drmModeDestroyPropertyBlob(kms_fd, old_blob_id);
+	}
+
+	return ret;
+}
+
+/*
+ * Turn the crtc of an output off or back on.  The planes keep their
+ * state, so the frame on screen when the crtc went off comes back with
+ * it.  Blocks until the commit is done.
+ */
+int hwc_context::atomic_set_active(struct kms_output *output, int active)
+{
+	drmModeAtomicReqPtr req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	ret = drmModeAtomicAddProperty(req, output->crtc_id,
+			output->crtc_prop.active, !!active) < 0 ? -ENOMEM : 0;
+	if (!ret)
+		ret = drmModeAtomicCommit(kms_fd, req,
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+/*
+ * Commit a frame to the planes of an output.  When out_fence is given and
+ * the crtc supports it, the kernel returns a fence signalled once the
+ * frame is on screen.
+ */
+int hwc_context::atomic_commit(struct kms_output *output,
+		const struct kms_layer *layers, uint32_t flags, int *out_fence)
+{
+	uint32_t damage_blobs[KMS_MAX_PLANES];
+	drmModeAtomicReqPtr req;
+	uint32_t i;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	/*
+	 * The kernel keeps its own reference to committed blobs, so ours
+	 * are dropped right after the commit.  A failed blob only costs
+	 * the partial update.
+	 */
+	memset(damage_blobs, 0, sizeof(damage_blobs));
+	for (i = 0; i < output->num_planes; i++) {
+		const struct kms_damage *damage = &layers[i].damage;
+
+		if (!layers[i].bo || !damage->count ||
+		    !output->planes[i].prop.fb_damage_clips ||
+		    (flags & DRM_MODE_ATOMIC_TEST_ONLY))
+			continue;
+		if (drmModeCreatePropertyBlob(kms_fd, damage->rects,
+				sizeof(damage->rects[0]) * damage->count,
+				&damage_blobs[i]))
+			damage_blobs[i] = 0;
+	}
+
+	ret = add_planes(req, output, layers, damage_blobs);
+	if (!ret && !(flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		ret = add_pending_color(req, output);
+	if (!ret && out_fence && output->crtc_prop.out_fence_ptr) {
+		*out_fence = -1;
+		if (drmModeAtomicAddProperty(req, output->crtc_id,
+				output->crtc_prop.out_fence_ptr,
+				(uint64_t) (uintptr_t) out_fence) < 0)
+			ret = -ENOMEM;
+	}
+	if (!ret)
+		ret = drmModeAtomicCommit(kms_fd, req, flags, (void *) output);
+	if (!ret && !(flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		color_committed(kms_fd, output);
+
+	for (i = 0; i < output->num_planes; i++) {
+		if (damage_blobs[i])
+			drmModeDestroyPropertyBlob(kms_fd, damage_blobs[i]);
+	}
+
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+/*
+ * Check that the crtc takes a colour transform along with the frame on
+ * screen.
+ */
+int hwc_context::atomic_test_color(struct kms_output *output,
+		uint32_t ctm_blob_id, uint32_t gamma_blob_id)
+{
+	drmModeAtomicReqPtr req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	ret = add_color(req, output, ctm_blob_id, gamma_blob_id);
+	if (!ret && drmModeAtomicCommit(kms_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+		ret = -errno;
+
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+} // namespace android
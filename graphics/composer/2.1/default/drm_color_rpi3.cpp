@@ -0,0 +1,185 @@
+#define LOG_TAG "composer@2.1-drm_color_rpi3"
+//#define LOG_NDEBUG 0
+
+#include <utils/Log.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "hwc_context.h"
+
+namespace android {
+
+#define COLOR_EPSILON 1e-4f
+
+/*
+ * The matrix of SET_COLOR_TRANSFORM is applied to row vectors: a channel
+ * c of the output is sum(in[k] * matrix[k * 4 + c]) + matrix[12 + c].
+ */
+static float color_coeff(const float *matrix, int in, int out)
+{
+	return matrix[in * 4 + out];
+}
+
+static float color_offset(const float *matrix, int out)
+{
+	return matrix[12 + out];
+}
+
+static uint16_t to_lut_value(float v)
+{
+	if (v < 0.0f)
+		v = 0.0f;
+	else if (v > 1.0f)
+		v = 1.0f;
+
+	return (uint16_t) lrintf(v * 65535.0f);
+}
+
+/* CTM coefficients are S31.32 sign-magnitude */
+static uint64_t to_ctm_value(float v)
+{
+	uint64_t mag = (uint64_t) (fabs((double) v) * 4294967296.0);
+
+	return v < 0.0f ? mag | (1ULL << 63) : mag;
+}
+
+/*
+ * Map a colour transform on the crtc of a display.  The 3x3 part goes to
+ * the CTM and the offsets to GAMMA_LUT, which follows the CTM in the
+ * pipeline.  A matrix that only scales channels is done by GAMMA_LUT
+ * alone.  The blobs are committed with the next frame.  Returns
+ * -EOPNOTSUPP when the crtc cannot apply the matrix.
+ */
+int hwc_context::set_color_transform(uint32_t display, const float *matrix)
+{
+	struct kms_output *output;
+	struct drm_color_ctm ctm;
+	struct drm_color_lut *lut;
+	uint32_t ctm_blob_id = 0, gamma_blob_id = 0;
+	int linear_identity = 1, diagonal = 1, offset = 0;
+	int use_ctm, use_lut;
+	uint32_t i;
+	int c, k, ret;
+
+	if (display >= num_outputs)
+		return -ENODEV;
+	output = &outputs[display];
+	if (!use_atomic)
+		return -EOPNOTSUPP;
+
+	for (c = 0; c < 3; c++) {
+		for (k = 0; k < 3; k++) {
+			float v = color_coeff(matrix, k, c);
+
+			if (c != k && fabsf(v) > COLOR_EPSILON)
+				diagonal = 0;
+			if (fabsf(v - (c == k ? 1.0f : 0.0f)) > COLOR_EPSILON)
+				linear_identity = 0;
+		}
+		if (fabsf(color_offset(matrix, c)) > COLOR_EPSILON)
+			offset = 1;
+	}
+
+	use_lut = offset || (diagonal && !linear_identity &&
+			output->crtc_prop.gamma_lut);
+	use_ctm = !linear_identity && !(diagonal && use_lut);
+	if ((use_ctm && !output->crtc_prop.ctm) ||
+	    (use_lut && (!output->crtc_prop.gamma_lut || output->gamma_lut_size < 2)))
+		return -EOPNOTSUPP;
+
+	if (use_ctm) {
+		for (c = 0; c < 3; c++) {
+			for (k = 0; k < 3; k++)
+				ctm.matrix[c * 3 + k] =
+					to_ctm_value(color_coeff(matrix, k, c));
+		}
+		ret = drmModeCreatePropertyBlob(kms_fd, &ctm, sizeof(ctm),
+				&ctm_blob_id);
+		if (ret)
+			return ret;
+	}
+
+	if (use_lut) {
+		lut = (struct drm_color_lut *)
+			calloc(output->gamma_lut_size, sizeof(*lut));
+		if (!lut) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		for (i = 0; i < output->gamma_lut_size; i++) {
+			float x = (float) i / (output->gamma_lut_size - 1);
+			float y[3];
+
+			for (c = 0; c < 3; c++) {
+				float scale = use_ctm ? 1.0f : color_coeff(matrix, c, c);
+
+				y[c] = x * scale + color_offset(matrix, c);
+			}
+			lut[i].red = to_lut_value(y[0]);
+			lut[i].green = to_lut_value(y[1]);
+			lut[i].blue = to_lut_value(y[2]);
+		}
+		ret = drmModeCreatePropertyBlob(kms_fd, lut,
+				sizeof(*lut) * output->gamma_lut_size, &gamma_blob_id);
+		free(lut);
+		if (ret)
+			goto fail;
+	}
+
+	ret = atomic_test_color(output, ctm_blob_id, gamma_blob_id);
+	if (ret) {
+		ALOGV("crtc %d rejected the colour transform (%d)",
+			output->crtc_id, ret);
+		ret = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	pthread_mutex_lock(&flip_lock);
+	/* blobs never committed are only referenced by us */
+	if (output->color_dirty) {
+		if (output->ctm_blob_id)
+			drmModeDestroyPropertyBlob(kms_fd, output->ctm_blob_id);
+		if (output->gamma_blob_id)
+			drmModeDestroyPropertyBlob(kms_fd, output->gamma_blob_id);
+	}
+	output->ctm_blob_id = ctm_blob_id;
+	output->gamma_blob_id = gamma_blob_id;
+	output->color_dirty = 1;
+	pthread_mutex_unlock(&flip_lock);
+
+	return 0;
+
+fail:
+	if (ctm_blob_id)
+		drmModeDestroyPropertyBlob(kms_fd, ctm_blob_id);
+	if (gamma_blob_id)
+		drmModeDestroyPropertyBlob(kms_fd, gamma_blob_id);
+	return ret;
+}
+
+/*
+ * The client is told to leave colour transforms to the composer only when
+ * every crtc has both a CTM and a GAMMA_LUT, which set_color_transform()
+ * can map any matrix to.
+ */
+bool hwc_context::color_transform_supported() const
+{
+	uint32_t i;
+
+	if (!use_atomic)
+		return false;
+
+	for (i = 0; i < num_outputs; i++) {
+		if (!outputs[i].crtc_prop.ctm || !outputs[i].crtc_prop.gamma_lut ||
+		    outputs[i].gamma_lut_size < 2)
+			return false;
+	}
+
+	return true;
+}
+
+} // namespace android
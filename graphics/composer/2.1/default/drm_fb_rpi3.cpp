@@ -0,0 +1,249 @@
+#define LOG_TAG "composer@2.1-drm_fb_rpi3"
+//#define LOG_NDEBUG 0
+
+#include <cutils/properties.h>
+#include <utils/Log.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "hwc_context.h"
+
+namespace android {
+
+#define ALIGN(val, align) (((val) + (align) - 1) & ~((align) - 1))
+
+/*
+ * Lay out the planes of a bo.  Chroma planes follow the luma plane in
+ * the same GEM object, as allocated by gralloc: the luma plane has an
+ * even number of rows, and YV12 chroma strides are half the luma stride
+ * aligned to 16 bytes.
+ */
+static void get_fb_planes(struct gralloc_drm_bo_t *bo, uint32_t drm_format,
+		uint32_t *handles, uint32_t *pitches, uint32_t *offsets)
+{
+	uint32_t stride = bo->handle->stride;
+	uint32_t luma_size = stride * ALIGN(bo->handle->height, 2);
+
+	handles[0] = bo->fb_handle;
+	pitches[0] = stride;
+	offsets[0] = 0;
+
+	switch (drm_format) {
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV21:
+		/* interleaved chroma, full stride, half height */
+		handles[1] = bo->fb_handle;
+		pitches[1] = stride;
+		offsets[1] = luma_size;
+		break;
+	case DRM_FORMAT_YVU420:
+		/* Cr then Cb, half stride, half height */
+		handles[1] = handles[2] = bo->fb_handle;
+		pitches[1] = pitches[2] = ALIGN(stride / 2, 16);
+		offsets[1] = luma_size;
+		offsets[2] = luma_size +
+			pitches[1] * (ALIGN(bo->handle->height, 2) / 2);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Add a fb object for a bo.
+ */
+static int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
+{
+	if (bo->fb_id)
+		return 0;
+
+	uint32_t pitches[4] = { 0, 0, 0, 0 };
+	uint32_t offsets[4] = { 0, 0, 0, 0 };
+	uint32_t handles[4] = { 0, 0, 0, 0 };
+
+	int drm_format = drm_format_from_hal(bo->handle->format);
+
+	if (drm_format == 0) {
+		ALOGE("error resolving drm format");
+		return -EINVAL;
+	}
+
+	get_fb_planes(bo, drm_format, handles, pitches, offsets);
+
+	return drmModeAddFB2(bo->drm->fd,
+		bo->handle->width, bo->handle->height,
+		drm_format, handles, pitches, offsets,
+		(uint32_t *) &bo->fb_id, 0);
+}
+
+/*
+ * Fbs the outputs may have queued or on screen at once, at most.
+ */
+uint32_t hwc_context::fb_pinned_posts() const
+{
+	return KMS_FB_PINNED_POSTS * (num_outputs ? num_outputs : 1);
+}
+
+void hwc_context::init_fb_cache()
+{
+	char value[PROPERTY_VALUE_MAX];
+	int capacity;
+	int pinned = fb_pinned_posts();
+
+	memset(&fb_cache, 0, sizeof(fb_cache));
+	memset(&fb_stats, 0, sizeof(fb_stats));
+
+	property_get("debug.hwc.fb_cache_size", value, "8");
+	capacity = atoi(value) * num_outputs;
+	if (capacity < pinned)
+		capacity = pinned;
+	if (capacity > KMS_FB_CACHE_SIZE)
+		capacity = KMS_FB_CACHE_SIZE;
+	fb_stats.capacity = capacity;
+}
+
+/*
+ * Whether a fb may be queued or on screen on an output.  An output
+ * without posts keeps its last frame on screen, however many posts the
+ * other outputs make meanwhile.
+ */
+int hwc_context::fb_pinned(const struct kms_fb *fb) const
+{
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++) {
+		if (fb->output_seq[i] &&
+		    fb->output_seq[i] + KMS_FB_PINNED_POSTS > outputs[i].post_seq)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the least recently used fb that cannot be on screen or queued.
+ * Returns the freed slot, or -1.
+ */
+int hwc_context::evict_fb()
+{
+	struct kms_fb *fb;
+	int victim = -1;
+	uint32_t i;
+
+	for (i = 0; i < fb_stats.count; i++) {
+		fb = &fb_cache[i];
+		if (fb_pinned(fb))
+			continue;
+		if (victim < 0 || fb->last_used < fb_cache[victim].last_used)
+			victim = i;
+	}
+	if (victim < 0)
+		return -1;
+
+	fb = &fb_cache[victim];
+	ALOGV("evicting fb %u of bo %p", fb->bo->fb_id, fb->bo);
+	if (fb->bo->fb_id) {
+		drmModeRmFB(kms_fd, fb->bo->fb_id);
+		fb->bo->fb_id = 0;
+	}
+	gralloc_drm_bo_decref(fb->bo);
+	fb->bo = NULL;
+	fb_stats.evictions++;
+
+	return victim;
+}
+
+/*
+ * Posts dropped before reaching the screen leave the frames queued, in
+ * flight or on screen of an output further behind its post_seq than the
+ * pinned window allows for.  Keep every fb pinned there now pinned for
+ * another window.
+ */
+void hwc_context::extend_fb_pins(const struct kms_output *output)
+{
+	uint32_t o = output - outputs;
+	struct kms_fb *fb;
+	uint32_t i;
+
+	for (i = 0; i < fb_stats.count; i++) {
+		fb = &fb_cache[i];
+		if (fb->output_seq[o] &&
+		    fb->output_seq[o] + KMS_FB_PINNED_POSTS > output->post_seq)
+			fb->output_seq[o] = output->post_seq;
+	}
+}
+
+/*
+ * Make sure a bo has a fb object, for the current post of output or, with
+ * no output, ahead of its first post.  Cached bos are referenced so that
+ * they outlive their fb, and are evicted least recently used first.
+ */
+int hwc_context::get_fb(const struct kms_output *output,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct kms_fb *fb;
+	int slot;
+	int err;
+	uint32_t i;
+
+	for (i = 0; i < fb_stats.count; i++) {
+		fb = &fb_cache[i];
+		if (fb->bo == bo) {
+			fb->last_used = post_seq;
+			if (output)
+				fb->output_seq[output - outputs] = output->post_seq;
+			fb_stats.hits++;
+			return 0;
+		}
+	}
+
+	fb_stats.misses++;
+	err = gralloc_drm_bo_add_fb(bo);
+	if (err) {
+		ALOGE("%s: could not create drm fb, (%s)",
+			__func__, strerror(-err));
+		return err;
+	}
+
+	if (fb_stats.count < fb_stats.capacity) {
+		slot = fb_stats.count++;
+	} else {
+		slot = evict_fb();
+		/*
+		 * every fb may be on screen, leave this one to gralloc,
+		 * which removes it when the bo goes away
+		 */
+		if (slot < 0)
+			return 0;
+	}
+
+	gralloc_drm_bo_incref(bo);
+	fb = &fb_cache[slot];
+	memset(fb, 0, sizeof(*fb));
+	fb->bo = bo;
+	fb->last_used = post_seq;
+	if (output)
+		fb->output_seq[output - outputs] = output->post_seq;
+
+	return 0;
+}
+
+/*
+ * Create the fb of a buffer ahead of its first post.
+ */
+int hwc_context::prepare_fb(buffer_handle_t handle)
+{
+	struct gralloc_drm_bo_t *bo;
+
+	bo = gralloc_drm_bo_from_handle(handle);
+	if (!bo)
+		return -EINVAL;
+
+	return get_fb(NULL, bo);
+}
+
+} // namespace android
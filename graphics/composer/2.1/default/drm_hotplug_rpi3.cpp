@@ -0,0 +1,118 @@
+#define LOG_TAG "composer@2.1-drm_hotplug_rpi3"
+//#define LOG_NDEBUG 0
+
+#include <utils/Log.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <hardware_legacy/uevent.h>
+
+#include "hwc_context.h"
+
+namespace android {
+
+#define UEVENT_MSG_LEN 2048
+
+int hwc_context::is_connected(uint32_t display) const
+{
+	return display < num_outputs && outputs[display].connected;
+}
+
+void hwc_context::set_hotplug_callback(kms_hotplug_proc_t proc, void *data)
+{
+	pthread_mutex_lock(&hotplug_lock);
+	hotplug_proc = proc;
+	hotplug_data = data;
+	pthread_mutex_unlock(&hotplug_lock);
+}
+
+/*
+ * Re-probe the outputs after a hotplug event, or only the output of
+ * connector_id when the kernel names it, and report what changed.
+ */
+void hwc_context::handle_hotplug(uint32_t connector_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++) {
+		if (connector_id && outputs[i].connector_id != connector_id)
+			continue;
+		if (!reprobe_output(i))
+			continue;
+
+		ALOGI("display %u %s", i,
+			outputs[i].connected ? "connected" : "disconnected");
+		pthread_mutex_lock(&hotplug_lock);
+		if (hotplug_proc)
+			hotplug_proc(hotplug_data, i, outputs[i].connected);
+		pthread_mutex_unlock(&hotplug_lock);
+	}
+}
+
+static void *hotplug_thread_main(void *arg)
+{
+	class hwc_context *ctx = (class hwc_context *) arg;
+
+	ctx->hotplug_loop();
+	return NULL;
+}
+
+/*
+ * Wait for drm change uevents.  The message is a list of NUL separated
+ * KEY=value strings, HOTPLUG=1 marks connector changes and newer kernels
+ * add the id of the connector that changed.
+ */
+void hwc_context::hotplug_loop()
+{
+	char msg[UEVENT_MSG_LEN + 2];
+	int len;
+
+	prctl(PR_SET_NAME, "hwc-hotplug", 0, 0, 0);
+
+	while (1) {
+		const char *s = msg;
+		int drm = 0, hotplug = 0;
+		uint32_t connector_id = 0;
+
+		len = uevent_next_event(msg, UEVENT_MSG_LEN);
+		if (len <= 0)
+			continue;
+		msg[len] = msg[len + 1] = '\0';
+
+		while (*s) {
+			if (!strcmp(s, "SUBSYSTEM=drm"))
+				drm = 1;
+			else if (!strcmp(s, "HOTPLUG=1"))
+				hotplug = 1;
+			else if (!strncmp(s, "CONNECTOR=", 10))
+				connector_id = strtoul(s + 10, NULL, 10);
+			s += strlen(s) + 1;
+		}
+
+		if (drm && hotplug) {
+			ALOGV("hotplug uevent, connector %u", connector_id);
+			handle_hotplug(connector_id);
+		}
+	}
+}
+
+int hwc_context::init_hotplug_thread()
+{
+	if (!uevent_init()) {
+		ALOGE("failed to open uevent socket, hotplug is not detected");
+		return -ENODEV;
+	}
+
+	if (pthread_create(&hotplug_thread, NULL, hotplug_thread_main, this)) {
+		ALOGE("failed to start hotplug thread");
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+} // namespace android
@@ -22,10 +22,13 @@
  */
 
 #define LOG_TAG "composer@2.1-drm_kms_rpi3"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 
 #include <cutils/properties.h>
+#include <cutils/trace.h>
 #include <utils/Log.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -33,17 +36,21 @@
 #include <string.h>
 #include <poll.h>
 #include <math.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
 #include <gralloc_drm.h>
 #include <gralloc_drm_priv.h>
-#include <hardware_legacy/uevent.h>
 
 #include <drm_fourcc.h>
+#include <sync/sync.h>
 
 #include "hwc_context.h"
 
 namespace android {
 
-static unsigned int drm_format_from_hal(int hal_format)
+unsigned int drm_format_from_hal(int hal_format)
 {
 	switch(hal_format) {
 		case HAL_PIXEL_FORMAT_RGB_888:
@@ -55,116 +62,1120 @@ static unsigned int drm_format_from_hal(int hal_format)
 			return DRM_FORMAT_RGBA8888;
 		case HAL_PIXEL_FORMAT_RGB_565:
 			return DRM_FORMAT_RGB565;
+		/* YV12 stores Cr before Cb */
 		case HAL_PIXEL_FORMAT_YV12:
-			return DRM_FORMAT_YUV420;
+			return DRM_FORMAT_YVU420;
+		case HAL_PIXEL_FORMAT_DRM_NV12:
+			return DRM_FORMAT_NV12;
+		case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+			return DRM_FORMAT_NV21;
 		default:
 			return 0;
 	}
 }
 
 /*
- * Add a fb object for a bo.
+ * Program CRTC.
+ */
+int hwc_context::set_crtc(struct kms_output *output, int fb_id)
+{
+	int ret;
+
+	ret = drmModeSetCrtc(kms_fd, output->crtc_id, fb_id,
+			0, 0, &output->connector_id, 1, &output->mode);
+	if (ret) {
+		ALOGE("failed to set crtc (%s) (crtc_id %d, fb_id %d, conn %d, mode %dx%d)",
+			strerror(errno), output->crtc_id, fb_id, output->connector_id,
+			output->mode.hdisplay, output->mode.vdisplay);
+		return ret;
+	}
+
+	return ret;
+}
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void record_commit(struct commit_stats *stats, int64_t start)
+{
+	int64_t elapsed = now_ns() - start;
+
+	stats->count++;
+	stats->total_ns += elapsed;
+	if (elapsed > stats->max_ns)
+		stats->max_ns = elapsed;
+}
+
+/* trace counters of the flip queues, by output */
+static const char *const queue_counters[KMS_MAX_OUTPUTS] = {
+	"flip queue 0", "flip queue 1", "flip queue 2", "flip queue 3",
+};
+
+/* trace counters of late frames, by output */
+static const char *const jank_counters[KMS_MAX_OUTPUTS] = {
+	"janky frames 0", "janky frames 1", "janky frames 2", "janky frames 3",
+};
+
+/* signal count fences of a flip timeline */
+static void signal_timeline(struct sw_timeline *tl, int count)
+{
+	while (count-- > 0)
+		sw_timeline_signal(tl);
+}
+
+/*
+ * Cookie of the async trace slice of the flip in flight, unique as long
+ * as pipes are below 8.
+ */
+static int32_t flip_cookie(const struct kms_output *output)
+{
+	return (int32_t) ((output->flip.frame << 3) | (output->pipe & 7));
+}
+
+/*
+ * Callback for a page flip event.  The sequence is the vblank counter of
+ * the crtc at the flip, the timestamp its vblank on the monotonic clock.
+ */
+static void page_flip_handler(int /*fd*/, unsigned int sequence,
+			      unsigned int tv_sec, unsigned int tv_usec,
+		void *user_data)
+{
+	struct kms_output *output = (struct kms_output *) user_data;
+
+	output->ctx->on_flip_complete(output, sequence,
+		(int64_t) tv_sec * 1000000000 + (int64_t) tv_usec * 1000);
+}
+
+void hwc_context::set_flip_callback(kms_flip_proc_t proc, void *data)
+{
+	pthread_mutex_lock(&flip_lock);
+	flip_proc = proc;
+	flip_data = data;
+	pthread_mutex_unlock(&flip_lock);
+}
+
+/*
+ * Tell the flip callback about the frame of the flip in flight.  Called
+ * with flip_lock held.
+ */
+void hwc_context::report_flip(struct kms_output *output, int64_t timestamp,
+		int done)
+{
+	if (flip_proc && output->flip.frame)
+		flip_proc(flip_data, output - outputs, output->flip.frame,
+			timestamp, done);
+}
+
+/*
+ * Check the flip in flight, which landed on vblank sequence, against the
+ * cadence of the previous flip: with swap_interval vblanks per frame it
+ * should have landed swap_interval vblanks later.  A frame presented so
+ * long after the previous flip that it could not make the vblank after
+ * the expected one starts a new run of frames instead, the display having
+ * been idle.  Called with flip_lock held.
  */
-static int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
+void hwc_context::check_jank(struct kms_output *output, unsigned int sequence,
+		int64_t timestamp)
 {
-	if (bo->fb_id)
+	struct kms_jank *jank = &output->jank;
+	int64_t period = drm_mode_period_ns(&output->mode);
+	unsigned int interval = swap_interval > 1 ? swap_interval : 1;
+	int64_t deadline;
+	int missed;
+
+	jank->flips++;
+	if (jank->last_ns && period > 0 && output->flip.present_ns) {
+		/* vblank counters wrap, differences do not */
+		missed = (int) (sequence - jank->last_seq - interval);
+		deadline = jank->last_ns + interval * period;
+		if (missed > 0 &&
+		    output->flip.present_ns <= deadline + period) {
+			jank->late++;
+			jank->repeated += missed;
+			if (output->flip.fence_pending)
+				jank->late_fence++;
+			else if (output->flip.present_ns > deadline)
+				jank->late_present++;
+			else
+				jank->late_commit++;
+			ATRACE_INT(jank_counters[output - outputs],
+				(int) jank->late);
+		}
+	}
+	jank->last_seq = sequence;
+	jank->last_ns = timestamp;
+}
+
+/*
+ * Ack the last scheduled flip of an output and start its next queued
+ * one.  Called with flip_lock held.
+ */
+void hwc_context::on_flip_complete(struct kms_output *output,
+		unsigned int sequence, int64_t timestamp)
+{
+	report_flip(output, timestamp, 1);
+	check_jank(output, sequence, timestamp);
+	if (output->flip.frame)
+		ATRACE_ASYNC_END("flip", flip_cookie(output));
+	output->flip.frame = 0;
+	output->current_front = output->next_front;
+	output->next_front = NULL;
+	signal_timeline(&output->flip_timeline, output->flip_on_timeline);
+	output->flip_on_timeline = 0;
+
+	submit_queued_flip(output);
+	pthread_cond_broadcast(&flip_cond);
+}
+
+/*
+ * Wait for the flip in flight on an output.  Called with flip_lock held.
+ */
+void hwc_context::wait_flip(struct kms_output *output)
+{
+	struct timespec timeout;
+
+	while (output->next_front) {
+		if (event_thread_running) {
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_sec += 1;
+			if (pthread_cond_timedwait(&flip_cond, &flip_lock,
+					&timeout) != ETIMEDOUT)
+				continue;
+		} else {
+			waiting_flip = 1;
+			drmHandleEvent(kms_fd, &evctx);
+			waiting_flip = 0;
+		}
+		if (output->next_front) {
+			/* record an error and break */
+			ALOGE("flip did not complete on crtc %d", output->crtc_id);
+			output->current_front = output->next_front;
+			output->next_front = NULL;
+			/* queued frames keep their fences for their own flips */
+			signal_timeline(&output->flip_timeline,
+				output->flip_on_timeline);
+			output->flip_on_timeline = 0;
+			/* the vblank of the flip is unknown */
+			output->jank.last_ns = 0;
+		}
+	}
+}
+
+/*
+ * Drop the acquire fences of a frame once the kernel has its own
+ * references, or the frame will not be shown.
+ */
+static void close_acquire_fences(const struct kms_layer *layers)
+{
+	uint32_t i;
+
+	for (i = 0; i < KMS_MAX_PLANES; i++) {
+		if (layers[i].acquire_fence >= 0)
+			close(layers[i].acquire_fence);
+	}
+}
+
+/*
+ * Schedule a page flip.  out_fence receives a fence signalled when the
+ * flip has completed, or -1.  The acquire fences of the frame are closed.
+ * Called with flip_lock held.
+ */
+int hwc_context::page_flip(struct kms_output *output,
+		const struct kms_layer *layers, int *out_fence)
+{
+	struct gralloc_drm_bo_t *bo;
+	int ret;
+
+	/* there is another flip pending */
+	wait_flip(output);
+
+	if (!layers)
 		return 0;
 
-	uint32_t pitches[4] = { 0, 0, 0, 0 };
-	uint32_t offsets[4] = { 0, 0, 0, 0 };
-	uint32_t handles[4] = { 0, 0, 0, 0 };
+	ATRACE_BEGIN("page_flip");
+	bo = layers[0].bo;
+	int64_t start = now_ns();
+	if (use_atomic) {
+		ret = atomic_commit(output, layers,
+				DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+				out_fence);
+		record_commit(&atomic_stats, start);
+	} else {
+		ret = drmModePageFlip(kms_fd, output->crtc_id, bo->fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, (void *) output);
+		record_commit(&legacy_stats, start);
+	}
+	close_acquire_fences(layers);
+	if (ret) {
+		ALOGE("failed to perform page flip (%s) (crtc %d fb %d))",
+			strerror(errno), output->crtc_id, bo->fb_id);
+		/* try to set mode for next frame */
+		if (errno != EBUSY)
+			output->first_post = 1;
+		else
+			output->jank.flip_busy++;
+	}
+	else {
+		output->next_front = bo;
+		output->flip = output->post;
+		report_flip(output, now_ns(), 0);
+		if (output->flip.frame)
+			ATRACE_ASYNC_BEGIN("flip", flip_cookie(output));
+		if (out_fence && *out_fence < 0) {
+			*out_fence = sw_timeline_fence(&output->flip_timeline,
+					"hwc-flip");
+			output->flip_on_timeline = *out_fence >= 0;
+		}
+	}
+	ATRACE_END();
+
+	return ret;
+}
 
-	pitches[0] = bo->handle->stride;
-	handles[0] = bo->fb_handle;
+/*
+ * A frame replacing one that never reached the screen changes what is on
+ * its planes by the damage of both, which is not known any more.
+ */
+static void damage_all(struct kms_layer *layers)
+{
+	uint32_t i;
 
-	int drm_format = drm_format_from_hal(bo->handle->format);
+	for (i = 0; i < KMS_MAX_PLANES; i++)
+		layers[i].damage.count = 0;
+}
 
-	if (drm_format == 0) {
-		ALOGE("error resolving drm format");
-		return -EINVAL;
+/*
+ * Drop the oldest queued frame of an output for a newer one.  Its present
+ * fences signal with the frame after it, which is when the buffers it was
+ * to replace leave the screen.  Returns the fences left to a frame not
+ * queued yet, when no other frame is queued.  Called with flip_lock held.
+ */
+int hwc_context::drop_queued_flip(struct kms_output *output)
+{
+	struct kms_frame *frame = &output->flip_queue[output->queue_head];
+	int fences = frame->timeline_fence;
+
+	unwatch_fence(output);
+	output->queue_head = (output->queue_head + 1) % KMS_MAX_QUEUED_FLIPS;
+	output->queue_len--;
+	output->queue_dropped++;
+	ATRACE_INT(queue_counters[output - outputs], output->queue_len);
+	close_acquire_fences(frame->layers);
+	extend_fb_pins(output);
+
+	if (!output->queue_len)
+		return fences;
+	frame = &output->flip_queue[output->queue_head];
+	frame->timeline_fence += fences;
+	damage_all(frame->layers);
+
+	return 0;
+}
+
+/*
+ * Queue a frame behind the flip in flight, or behind the acquire fences
+ * of the oldest queued frame.  While the queue is full this blocks, or
+ * with queue_mailbox drops the oldest queued frame.  A frame with nothing
+ * ahead of it is committed at once when its fences have signalled, and by
+ * the event thread when they do otherwise.  The kernel hands out fences at
+ * commit time, so the present fence of a queued frame comes from
+ * flip_timeline.  Called with flip_lock held.
+ */
+int hwc_context::queue_flip(struct kms_output *output,
+		struct kms_layer *layers, int *out_fence)
+{
+	struct kms_frame *frame;
+	struct timespec timeout;
+	int dropped_fences = 0;
+
+	if (queue_mailbox) {
+		while (output->queue_len && output->queue_len >= queue_depth)
+			dropped_fences += drop_queued_flip(output);
+	}
+
+	while (output->queue_len >= queue_depth) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 1;
+		if (pthread_cond_timedwait(&flip_cond, &flip_lock,
+				&timeout) == ETIMEDOUT) {
+			ALOGE("flip queue of crtc %d did not drain",
+				output->crtc_id);
+			break;
+		}
+	}
+
+	/* flips got stuck, the caller takes over */
+	if (output->queue_len >= queue_depth) {
+		wait_acquire_fences(output, layers, 0);
+		return page_flip(output, layers, out_fence);
+	}
+
+	frame = &output->flip_queue[(output->queue_head + output->queue_len) %
+		KMS_MAX_QUEUED_FLIPS];
+	memcpy(frame->layers, layers, sizeof(frame->layers));
+	if (dropped_fences)
+		damage_all(frame->layers);
+	*out_fence = sw_timeline_fence(&output->flip_timeline, "hwc-flip");
+	frame->timeline_fence = dropped_fences + (*out_fence >= 0);
+	frame->post = output->post;
+	output->queue_len++;
+	ATRACE_INT(queue_counters[output - outputs], output->queue_len);
+
+	submit_queued_flip(output);
+
+	return 0;
+}
+
+/*
+ * Commit a frame held back by the flip queue or the late latch, once the
+ * acquire fences the commit cannot take have signalled.  A frame that
+ * cannot be shown signals its fences at once.  Called with flip_lock
+ * held.
+ */
+void hwc_context::submit_frame(struct kms_output *output,
+		struct kms_frame *frame)
+{
+	/* only waits when the caller did not watch the fences */
+	wait_acquire_fences(output, frame->layers, 0);
+
+	/* a modeset is pending, bo_post brings the crtc back */
+	output->post = frame->post;
+	if (output->first_post)
+		close_acquire_fences(frame->layers);
+	if (output->first_post ||
+	    page_flip(output, frame->layers, NULL)) {
+		signal_timeline(&output->flip_timeline, frame->timeline_fence);
+		return;
+	}
+	output->flip_on_timeline = frame->timeline_fence;
+}
+
+/*
+ * Whether the commit hands the acquire fence of a plane to the kernel.
+ */
+int hwc_context::kernel_waits_fence(const struct kms_output *output,
+		uint32_t plane) const
+{
+	return use_atomic && plane < output->num_planes &&
+		output->planes[plane].prop.in_fence_fd;
+}
+
+/*
+ * The first acquire fence of a frame that has not signalled and that the
+ * commit cannot hand to the kernel, or -1.
+ */
+int hwc_context::blocking_fence(const struct kms_output *output,
+		const struct kms_layer *layers) const
+{
+	uint32_t i;
+	int fence;
+
+	for (i = 0; i < KMS_MAX_PLANES; i++) {
+		fence = layers[i].acquire_fence;
+		/* a failed fence is as good as signalled */
+		if (fence >= 0 && !kernel_waits_fence(output, i) &&
+		    sync_wait(fence, 0) && errno == ETIME)
+			return fence;
+	}
+
+	return -1;
+}
+
+/*
+ * Have the event thread wait for the blocking fence of a frame about to
+ * be committed.  Returns 1 while the fence is pending, and 0 once the
+ * frame can go, having waited here when there is no event thread to wait.
+ * Called with flip_lock held.
+ */
+int hwc_context::watch_fence(struct kms_output *output,
+		struct kms_layer *layers)
+{
+	struct epoll_event ev;
+	int fence = blocking_fence(output, layers);
+
+	if (fence == output->watched_fence && fence >= 0)
+		return 1;
+	unwatch_fence(output);
+	if (fence < 0)
+		return 0;
+
+	if (event_thread_running) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fence;
+		if (!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fence, &ev)) {
+			output->watched_fence = fence;
+			return 1;
+		}
+		ALOGW("failed to watch acquire fence (%s)", strerror(errno));
+	}
+	wait_acquire_fences(output, layers, 0);
+
+	return 0;
+}
+
+/*
+ * Stop watching the fence of an output, before the fence is closed.
+ * Called with flip_lock held.
+ */
+void hwc_context::unwatch_fence(struct kms_output *output)
+{
+	if (output->watched_fence < 0)
+		return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, output->watched_fence, NULL);
+	output->watched_fence = -1;
+}
+
+/*
+ * An acquire fence watched by the event thread has signalled, go on with
+ * its frame.  Called from the event thread with flip_lock held.
+ */
+void hwc_context::on_fence_signaled(int fd)
+{
+	struct kms_output *output;
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++) {
+		output = &outputs[i];
+		if (output->watched_fence != fd)
+			continue;
+		if (output->latch_pending)
+			submit_latched(output);
+		else
+			submit_queued_flip(output);
+		pthread_cond_broadcast(&flip_cond);
+		return;
+	}
+}
+
+/*
+ * Start the oldest queued frame of an output once nothing is in flight
+ * and its acquire fences have signalled.  Called with flip_lock held.
+ */
+void hwc_context::submit_queued_flip(struct kms_output *output)
+{
+	struct kms_frame *frame;
+
+	while (output->queue_len && !output->next_front) {
+		frame = &output->flip_queue[output->queue_head];
+		if (watch_fence(output, frame->layers))
+			break;
+		output->queue_head = (output->queue_head + 1) % KMS_MAX_QUEUED_FLIPS;
+		output->queue_len--;
+		ATRACE_INT(queue_counters[output - outputs], output->queue_len);
+
+		submit_frame(output, frame);
+	}
+}
+
+/*
+ * Commit the oldest queued frame of an output without waiting for the
+ * event thread to see its fences signal, waiting for them here instead.
+ * Called with flip_lock held.
+ */
+void hwc_context::submit_waiting_flip(struct kms_output *output)
+{
+	unwatch_fence(output);
+	wait_acquire_fences(output,
+		output->flip_queue[output->queue_head].layers, 0);
+	submit_queued_flip(output);
+}
+
+/*
+ * Commit the latched frame of an output at once, and wait for every flip
+ * of the output to land.  Called with flip_lock held.
+ */
+void hwc_context::drain_flips(struct kms_output *output)
+{
+	if (output->latch_pending) {
+		output->latch_pending = 0;
+		unwatch_fence(output);
+		submit_frame(output, &output->latched);
+	}
+	while (output->next_front || output->queue_len) {
+		if (output->next_front)
+			wait_flip(output);
+		else
+			submit_waiting_flip(output);
+	}
+}
+
+/*
+ * Time a commit takes to submit, on average, on the current commit path.
+ */
+int64_t hwc_context::commit_cost() const
+{
+	const struct commit_stats *stats =
+		use_atomic ? &atomic_stats : &legacy_stats;
+
+	return stats->count ? stats->total_ns / (int64_t) stats->count : 0;
+}
+
+/*
+ * Hold a frame posted while no flip is in flight until shortly before
+ * the next vblank, predicted from the last flip, so that a frame posted
+ * meanwhile can take its place and reach the screen at the same vblank.
+ * The replaced frame is dropped, its fences signal with the frame
+ * replacing it.  Returns 1, leaving the frame to the caller, when the
+ * deadline has passed already or no vblank can be predicted.  Called
+ * with flip_lock held.
+ */
+int hwc_context::latch_frame(struct kms_output *output,
+		const struct kms_layer *layers, int *out_fence)
+{
+	struct kms_frame *frame = &output->latched;
+	int64_t now, period, vblank, deadline;
+	int replaced = output->latch_pending;
+
+	if (replaced) {
+		unwatch_fence(output);
+		close_acquire_fences(frame->layers);
+		extend_fb_pins(output);
+		output->latch_replaced++;
+		/* the deadline may have passed while the fences were watched */
+		arm_latch_timer();
+	} else {
+		now = now_ns();
+		period = drm_mode_period_ns(&output->mode);
+		if (!output->jank.last_ns || period <= 0 ||
+		    output->flip_timeline.fd < 0)
+			return 1;
+		vblank = output->jank.last_ns +
+			((now - output->jank.last_ns) / period + 1) * period;
+		deadline = vblank - latch_offset_ns - commit_cost();
+		if (deadline <= now)
+			return 1;
+
+		frame->timeline_fence = 0;
+		output->latch_ns = deadline;
+		output->latch_pending = 1;
+		arm_latch_timer();
+	}
+	output->latch_count++;
+
+	memcpy(frame->layers, layers, sizeof(frame->layers));
+	if (replaced)
+		damage_all(frame->layers);
+	frame->post = output->post;
+	*out_fence = sw_timeline_fence(&output->flip_timeline, "hwc-flip");
+	frame->timeline_fence += *out_fence >= 0;
+
+	return 0;
+}
+
+/*
+ * Wake the event thread at the earliest latch deadline of the outputs.
+ * Called with flip_lock held.
+ */
+void hwc_context::arm_latch_timer()
+{
+	struct itimerspec its;
+	int64_t next = 0;
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++) {
+		if (outputs[i].latch_pending &&
+		    (!next || outputs[i].latch_ns < next))
+			next = outputs[i].latch_ns;
+	}
+
+	/* a zero it_value disarms the timer */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000;
+	its.it_value.tv_nsec = next % 1000000000;
+	if (timerfd_settime(latch_timer, TFD_TIMER_ABSTIME, &its, NULL))
+		ALOGE("failed to arm the latch timer (%s)", strerror(errno));
+}
+
+/*
+ * Commit the latched frame of an output whose deadline has come, once its
+ * acquire fences have signalled.  Called with flip_lock held.
+ */
+void hwc_context::submit_latched(struct kms_output *output)
+{
+	if (watch_fence(output, output->latched.layers))
+		return;
+	output->latch_pending = 0;
+	ATRACE_BEGIN("late latch");
+	submit_frame(output, &output->latched);
+	ATRACE_END();
+}
+
+/*
+ * Commit the latched frames whose deadline has come.  Called from the
+ * event thread with flip_lock held.
+ */
+void hwc_context::submit_latched_frames()
+{
+	uint64_t expirations;
+	int64_t now;
+	uint32_t i;
+
+	if (read(latch_timer, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		ALOGW("failed to read the latch timer (%s)", strerror(errno));
+
+	now = now_ns();
+	for (i = 0; i < num_outputs; i++) {
+		struct kms_output *output = &outputs[i];
+
+		if (output->latch_pending && output->latch_ns <= now)
+			submit_latched(output);
+	}
+	arm_latch_timer();
+}
+
+static void *event_thread_main(void *arg)
+{
+	class hwc_context *ctx = (class hwc_context *) arg;
+
+	ctx->event_loop();
+	return NULL;
+}
+
+/*
+ * Deliver DRM events as they arrive, so that flips complete and queued
+ * frames get submitted without a caller having to wait for them.  Events
+ * of all outputs arrive on the same fd.
+ */
+void hwc_context::event_loop()
+{
+	struct epoll_event ev;
+	uint32_t i;
+	int n;
+
+	prctl(PR_SET_NAME, "hwc-drm-events", 0, 0, 0);
+
+	while (1) {
+		n = epoll_wait(epoll_fd, &ev, 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("epoll_wait failed (%s)", strerror(errno));
+			break;
+		}
+		if (!n)
+			continue;
+
+		pthread_mutex_lock(&flip_lock);
+		if (ev.data.fd == kms_fd)
+			drmHandleEvent(kms_fd, &evctx);
+		else if (ev.data.fd == latch_timer)
+			submit_latched_frames();
+		else
+			on_fence_signaled(ev.data.fd);
+		pthread_mutex_unlock(&flip_lock);
+	}
+
+	/* let waiters handle events and fences themselves */
+	pthread_mutex_lock(&flip_lock);
+	event_thread_running = 0;
+	for (i = 0; i < num_outputs; i++) {
+		if (outputs[i].queue_len && !outputs[i].next_front)
+			submit_waiting_flip(&outputs[i]);
+	}
+	pthread_cond_broadcast(&flip_cond);
+	pthread_mutex_unlock(&flip_lock);
+}
+
+int hwc_context::init_event_thread()
+{
+	char value[PROPERTY_VALUE_MAX];
+	struct epoll_event ev;
+	int depth;
+
+	property_get("debug.hwc.event_thread", value, "1");
+	if (!atoi(value)) {
+		ALOGI("drm event thread disabled by debug.hwc.event_thread");
+		return -EPERM;
+	}
+
+	/* shallow queues keep latency down, deep ones keep the crtc busy */
+	property_get("debug.hwc.flip_queue_depth", value, "1");
+	depth = atoi(value);
+	if (depth < 1)
+		depth = 1;
+	if (depth > KMS_MAX_QUEUED_FLIPS)
+		depth = KMS_MAX_QUEUED_FLIPS;
+	queue_depth = depth;
+	property_get("debug.hwc.flip_queue_mailbox", value, "0");
+	queue_mailbox = atoi(value) != 0;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		ALOGE("failed to create epoll fd (%s)", strerror(errno));
+		return -errno;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = kms_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, kms_fd, &ev)) {
+		ALOGE("failed to watch drm fd (%s)", strerror(errno));
+		close(epoll_fd);
+		epoll_fd = -1;
+		return -errno;
+	}
+
+	event_thread_running = 1;
+	if (pthread_create(&event_thread, NULL, event_thread_main, this)) {
+		ALOGE("failed to start drm event thread");
+		event_thread_running = 0;
+		close(epoll_fd);
+		epoll_fd = -1;
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up the late latch from debug.hwc.latch_offset_us, the time before
+ * the vblank by which a held frame must be committed on top of the commit
+ * cost.  It needs the event thread to commit the frames and vblank
+ * timestamps to predict the vblanks; negative offsets disable it.
+ */
+void hwc_context::init_late_latch()
+{
+	char value[PROPERTY_VALUE_MAX];
+	struct epoll_event ev;
+	int offset_us;
+
+	property_get("debug.hwc.latch_offset_us", value, "-1");
+	offset_us = atoi(value);
+	if (offset_us < 0 || !event_thread_running || !hw_vsync)
+		return;
+
+	latch_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (latch_timer < 0) {
+		ALOGE("failed to create latch timer (%s)", strerror(errno));
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = latch_timer;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, latch_timer, &ev)) {
+		ALOGE("failed to watch latch timer (%s)", strerror(errno));
+		close(latch_timer);
+		latch_timer = -1;
+		return;
+	}
+
+	latch_offset_ns = (int64_t) offset_us * 1000;
+	ALOGI("late latch %d us before vblank", offset_us);
+}
+
+/*
+ * Move the cursor plane of a display.  This goes through the legacy cursor
+ * ioctl, which atomic drivers apply asynchronously, so it is neither held
+ * back by a pending flip nor waits for one.
+ */
+int hwc_context::move_cursor(uint32_t display, int32_t x, int32_t y)
+{
+	struct kms_output *output;
+
+	if (display >= num_outputs)
+		return -ENODEV;
+	output = &outputs[display];
+	if (!use_atomic || !output->cursor_plane || output->first_post)
+		return -EAGAIN;
+
+	if (drmModeMoveCursor(kms_fd, output->crtc_id, x, y))
+		return -errno;
+
+	return 0;
+}
+
+void hwc_context::cursor_size(uint32_t *width, uint32_t *height) const
+{
+	*width = cursor_width;
+	*height = cursor_height;
+}
+
+/*
+ * Add the crtc selector of an output to a vblank request type.
+ */
+unsigned int hwc_context::vblank_type(const struct kms_output *output,
+		unsigned int type) const
+{
+	uint32_t pipe = output->pipe;
+
+	if (pipe == 1)
+		type |= DRM_VBLANK_SECONDARY;
+	else if (pipe > 1)
+		type |= (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+			DRM_VBLANK_HIGH_CRTC_MASK;
+
+	return type;
+}
+
+/*
+ * The refresh period of a mode.  mode.vrefresh is rounded to an integer,
+ * so derive it from the pixel clock and the totals instead.
+ */
+int64_t drm_mode_period_ns(const drmModeModeInfo *mode)
+{
+	int64_t lines;
+
+	if (!mode->clock || !mode->htotal || !mode->vtotal)
+		return mode->vrefresh ? 1000000000LL / mode->vrefresh : 16666667;
+
+	lines = mode->vtotal;
+	if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+		lines = (lines + 1) / 2;
+	if (mode->flags & DRM_MODE_FLAG_DBLSCAN)
+		lines *= 2;
+	if (mode->vscan > 1)
+		lines *= mode->vscan;
+
+	/* clock is in kHz */
+	return (int64_t) mode->htotal * lines * 1000000LL / mode->clock;
+}
+
+int64_t hwc_context::vsync_period_ns(uint32_t display) const
+{
+	if (display >= num_outputs)
+		return 16666667;
+
+	return drm_mode_period_ns(&outputs[display].mode);
+}
+
+/*
+ * Program a mode on an output.  The modeset reuses the fb on screen, so
+ * it takes effect without waiting for a frame of the new size.  When the
+ * fb cannot be scanned out in the new mode, the modeset is left to the
+ * next post.  Called with flip_lock held.
+ */
+int hwc_context::switch_mode(struct kms_output *output,
+		const drmModeModeInfo *mode)
+{
+	drmModeModeInfo old_mode;
+	int ret = 0;
+
+	if (!memcmp(mode, &output->mode, sizeof(*mode)))
+		return 0;
+
+	drain_flips(output);
+
+	old_mode = output->mode;
+	output->mode = *mode;
+
+	if (output->first_post || !output->current_front) {
+		/* nothing on screen yet, the first post sets the mode */
+		if (use_atomic && output->mode_blob_id) {
+			drmModeDestroyPropertyBlob(kms_fd, output->mode_blob_id);
+			output->mode_blob_id = 0;
+			ret = drmModeCreatePropertyBlob(kms_fd, mode, sizeof(*mode),
+					&output->mode_blob_id);
+		}
+	} else if (use_atomic) {
+		ret = atomic_set_mode(output, mode);
+	} else if (output->current_front->handle->width >= mode->hdisplay &&
+		   output->current_front->handle->height >= mode->vdisplay) {
+		ret = set_crtc(output, output->current_front->fb_id);
+	} else {
+		output->first_post = 1;
+	}
+
+	if (ret)
+		output->mode = old_mode;
+	else
+		set_dpi(output);
+
+	return ret;
+}
+
+/*
+ * The mode a display dozes in: the active mode at its lowest refresh
+ * rate.
+ */
+static uint32_t find_doze_mode(const struct kms_output *output)
+{
+	const drmModeModeInfo *active = &output->modes[output->active_mode];
+	uint32_t doze = output->active_mode;
+	uint32_t i;
+
+	for (i = 0; i < output->num_modes; i++) {
+		const drmModeModeInfo *mode = &output->modes[i];
+
+		if (mode->hdisplay != active->hdisplay ||
+		    mode->vdisplay != active->vdisplay ||
+		    (mode->flags & DRM_MODE_FLAG_INTERLACE))
+			continue;
+		if (drm_mode_period_ns(mode) >
+		    drm_mode_period_ns(&output->modes[doze]))
+			doze = i;
 	}
 
-	return drmModeAddFB2(bo->drm->fd,
-		bo->handle->width, bo->handle->height,
-		drm_format, handles, pitches, offsets,
-		(uint32_t *) &bo->fb_id, 0);
+	return doze;
 }
 
 /*
- * Program CRTC.
+ * Switch a display to another of its modes.  While the display dozes the
+ * doze mode of the new resolution is programmed instead, and while it is
+ * off the mode is programmed when it comes back on.
  */
-int hwc_context::set_crtc(struct kms_output *output, int fb_id)
+int hwc_context::set_mode(uint32_t display, uint32_t mode)
 {
-	int ret;
+	struct kms_output *output;
+	uint32_t old_active;
+	int ret = 0;
+
+	if (display >= num_outputs)
+		return -ENODEV;
+	output = &outputs[display];
+
+	/* the hotplug thread replaces the modes of a sink coming back */
+	pthread_mutex_lock(&flip_lock);
+	if (mode >= output->num_modes) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (mode == output->active_mode)
+		goto out;
+
+	old_active = output->active_mode;
+	output->active_mode = mode;
+	if (output->power_mode == KMS_POWER_ON)
+		ret = switch_mode(output, &output->modes[mode]);
+	else if (output->power_mode == KMS_POWER_DOZE)
+		ret = switch_mode(output, &output->modes[find_doze_mode(output)]);
 
-	ret = drmModeSetCrtc(kms_fd, output->crtc_id, fb_id,
-			0, 0, &output->connector_id, 1, &output->mode);
 	if (ret) {
-		ALOGE("failed to set crtc (%s) (crtc_id %d, fb_id %d, conn %d, mode %dx%d)",
-			strerror(errno), output->crtc_id, fb_id, output->connector_id,
-			output->mode.hdisplay, output->mode.vdisplay);
-		return ret;
+		output->active_mode = old_active;
+	} else {
+		ALOGI("display %u: switched to %s, vsync period %" PRId64 " ns",
+			display, output->modes[mode].name, vsync_period_ns(display));
 	}
 
+out:
+	pthread_mutex_unlock(&flip_lock);
+
 	return ret;
 }
 
 /*
- * Callback for a page flip event.
+ * Turn the crtc of an output off or back on, keeping the frame on screen
+ * for when it comes back.  Without atomic or DPMS, the crtc is turned off
+ * for good and the next post sets the mode again.  Called with flip_lock
+ * held.
  */
-static void page_flip_handler(int /*fd*/, unsigned int /*sequence*/,
-			      unsigned int /*tv_sec*/, unsigned int /*tv_usec*/,
-		void *user_data)
+int hwc_context::set_active(struct kms_output *output, int active)
 {
-	class hwc_context *ctx = (class hwc_context *) user_data;
+	int ret = 0;
+
+	drain_flips(output);
+
+	/* the crtc is off already, the first post turns it on */
+	if (output->first_post || !output->current_front)
+		return 0;
+
+	if (use_atomic) {
+		ret = atomic_set_active(output, active);
+	} else if (output->dpms_prop) {
+		ret = drmModeConnectorSetProperty(kms_fd, output->connector_id,
+				output->dpms_prop,
+				active ? DRM_MODE_DPMS_ON : DRM_MODE_DPMS_OFF);
+	} else if (!active) {
+		ret = drmModeSetCrtc(kms_fd, output->crtc_id, 0, 0, 0, NULL, 0, NULL);
+		if (!ret) {
+			output->first_post = 1;
+			output->current_front = NULL;
+		}
+	}
+	if (ret)
+		ALOGE("failed to turn %s crtc %d (%s)", active ? "on" : "off",
+			output->crtc_id, strerror(errno));
 
-	/* ack the last scheduled flip */
-	ctx->current_front = ctx->next_front;
-	ctx->next_front = NULL;
+	return ret;
 }
 
 /*
- * Schedule a page flip.
+ * Set the power mode of a display.  Off turns the crtc off and drops the
+ * frames posted meanwhile.  Doze keeps the display on at the lowest
+ * refresh rate of the active resolution.
  */
-int hwc_context::page_flip(struct gralloc_drm_bo_t *bo)
+int hwc_context::set_power_mode(uint32_t display, int mode)
 {
-	int ret;
+	struct kms_output *output;
+	int ret = 0;
 
-	/* there is another flip pending */
-	while (next_front) {
-		waiting_flip = 1;
-		drmHandleEvent(kms_fd, &evctx);
-		waiting_flip = 0;
-		if (next_front) {
-			/* record an error and break */
-			ALOGE("drmHandleEvent returned without flipping");
-			current_front = next_front;
-			next_front = NULL;
-		}
-	}
+	if (display >= num_outputs)
+		return -ENODEV;
+	output = &outputs[display];
+	if (mode != KMS_POWER_OFF && mode != KMS_POWER_DOZE && mode != KMS_POWER_ON)
+		return -EINVAL;
 
-	if (!bo)
-		return 0;
+	pthread_mutex_lock(&flip_lock);
 
-	ret = drmModePageFlip(kms_fd, primary_output.crtc_id, bo->fb_id,
-			DRM_MODE_PAGE_FLIP_EVENT, (void *) this);
-	if (ret) {
-		ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d))",
-			strerror(errno), primary_output.crtc_id, bo->fb_id);
-		/* try to set mode for next frame */
-		if (errno != EBUSY)
-			first_post = 1;
+	if (mode == output->power_mode)
+		goto out;
+
+	if (mode == KMS_POWER_OFF) {
+		ret = set_active(output, 0);
+		if (!ret)
+			output->power_mode = mode;
+		goto out;
+	}
+
+	if (output->power_mode == KMS_POWER_OFF) {
+		ret = set_active(output, 1);
+		if (ret)
+			goto out;
+		output->power_mode = KMS_POWER_ON;
 	}
+
+	if (mode == KMS_POWER_DOZE)
+		ret = switch_mode(output, &output->modes[find_doze_mode(output)]);
 	else
-		next_front = bo;
+		ret = switch_mode(output, &output->modes[output->active_mode]);
+	if (!ret)
+		output->power_mode = mode;
+
+	ALOGI("display %u: power mode %d, vsync period %" PRId64 " ns",
+		display, output->power_mode, vsync_period_ns(display));
+
+out:
+	pthread_mutex_unlock(&flip_lock);
 
 	return ret;
 }
 
+/*
+ * Block until the next vblank of a display and return its kernel
+ * timestamp on CLOCK_MONOTONIC.  Fails when the crtc is off or the driver
+ * does not timestamp vblanks on the monotonic clock.
+ */
+int hwc_context::wait_vblank(uint32_t display, int64_t *timestamp)
+{
+	drmVBlank vbl;
+
+	if (!hw_vsync || display >= num_outputs)
+		return -ENOTSUP;
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = (drmVBlankSeqType)
+		vblank_type(&outputs[display], DRM_VBLANK_RELATIVE);
+	vbl.request.sequence = 1;
+	if (drmWaitVBlank(kms_fd, &vbl))
+		return -errno;
+
+	*timestamp = (int64_t) vbl.reply.tval_sec * 1000000000LL +
+		(int64_t) vbl.reply.tval_usec * 1000;
+
+	return 0;
+}
+
 /*
  * Wait for the next post.
  */
-void hwc_context::wait_for_post(int flip)
+void hwc_context::wait_for_post(struct kms_output *output, int flip)
 {
 	unsigned int current, target;
 	drmVBlank vbl;
@@ -173,7 +1184,7 @@ void hwc_context::wait_for_post(int flip)
 	flip = !!flip;
 
 	memset(&vbl, 0, sizeof(vbl));
-	int type = DRM_VBLANK_RELATIVE;
+	int type = vblank_type(output, DRM_VBLANK_RELATIVE);
 	vbl.request.type = (drmVBlankSeqType) type;
 	vbl.request.sequence = 0;
 
@@ -185,15 +1196,15 @@ void hwc_context::wait_for_post(int flip)
 	}
 
 	current = vbl.reply.sequence;
-	if (first_post)
+	if (output->first_post)
 		target = current;
 	else
-		target = last_swap + swap_interval - flip;
+		target = output->last_swap + swap_interval - flip;
 
 	/* wait for vblank */
 	if (current < target || !flip) {
 		memset(&vbl, 0, sizeof(vbl));
-		int type = DRM_VBLANK_ABSOLUTE;
+		int type = vblank_type(output, DRM_VBLANK_ABSOLUTE);
 		if (!flip) {
 			type |= DRM_VBLANK_NEXTONMISS;
 			if (target < current)
@@ -209,53 +1220,166 @@ void hwc_context::wait_for_post(int flip)
 		}
 	}
 
-	last_swap = vbl.reply.sequence + flip;
+	output->last_swap = vbl.reply.sequence + flip;
 }
 
 /*
- * Post a bo.  This is not thread-safe.
+ * Wait for the buffers of a frame to be ready and close their fences.
+ * Unless all is set, fences the atomic commit can hand to the kernel as
+ * IN_FENCE_FD are left to it.
  */
-int hwc_context::bo_post(struct gralloc_drm_bo_t *bo)
+void hwc_context::wait_acquire_fences(struct kms_output *output,
+		struct kms_layer *layers, int all)
 {
-	int ret;
+	uint32_t i;
+	int fence;
+
+	for (i = 0; i < KMS_MAX_PLANES; i++) {
+		fence = layers[i].acquire_fence;
+		if (fence < 0)
+			continue;
+		if (!all && kernel_waits_fence(output, i))
+			continue;
+		ATRACE_BEGIN("acquire fence wait");
+		if (sync_wait(fence, -1))
+			ALOGW("acquire fence of plane %u failed (%s)", i,
+				strerror(errno));
+		ATRACE_END();
+		close(fence);
+		layers[i].acquire_fence = -1;
+	}
+}
 
-	if (!bo->fb_id) {
-		int err = gralloc_drm_bo_add_fb(bo);
-		if (err) {
-			ALOGE("%s: could not create drm fb, (%s)",
-				__func__, strerror(-err));
-			ALOGE("unable to post bo %p without fb", bo);
-			return err;
-		}
+/*
+ * Whether an acquire fence of a frame has yet to signal.
+ */
+static int fences_pending(const struct kms_layer *layers)
+{
+	uint32_t i;
+
+	for (i = 0; i < KMS_MAX_PLANES; i++) {
+		if (layers[i].acquire_fence >= 0 &&
+		    sync_wait(layers[i].acquire_fence, 0))
+			return 1;
 	}
 
-	/* TODO spawn a thread to avoid waiting and race */
+	return 0;
+}
+
+/*
+ * Post a frame to an output, layers[0] being the bo of the primary plane.
+ * With the event thread running this only waits when the flip queue of
+ * the output is full, or for a modeset; acquire fences the kernel cannot
+ * take are waited for by the event thread.
+ */
+int hwc_context::bo_post(struct kms_output *output,
+		const struct kms_post *post, struct kms_layer *layers,
+		int *out_fence)
+{
+	struct gralloc_drm_bo_t *bo = layers[0].bo;
+	uint32_t i;
+	int ret;
+
+	/* nothing else could wait for the fences */
+	if (!event_thread_running)
+		wait_acquire_fences(output, layers, 0);
+
+	if (swap_interval > 1 && !output->first_post) {
+		ATRACE_BEGIN("wait_for_post");
+		wait_for_post(output, 1);
+		ATRACE_END();
+	}
 
-	if (first_post) {
-		ret = set_crtc(&primary_output, bo->fb_id);
+	pthread_mutex_lock(&flip_lock);
+	output->post = *post;
+
+	if (output->first_post) {
+		/* let pending flips land before reprogramming the crtc */
+		drain_flips(output);
+		/* the modeset may fall back to legacy, which takes no fences */
+		wait_acquire_fences(output, layers, 1);
+
+		ret = -EINVAL;
+		if (use_atomic) {
+			ret = atomic_modeset(output, layers);
+			if (ret) {
+				ALOGW("falling back to legacy modesetting");
+				use_atomic = 0;
+				for (i = 0; i < num_outputs; i++) {
+					if (outputs[i].flip_timeline.fd < 0)
+						sw_timeline_init(&outputs[i].flip_timeline);
+				}
+			}
+		}
+		if (!use_atomic)
+			ret = set_crtc(output, bo->fb_id);
 		if (!ret) {
-			first_post = 0;
-			current_front = bo;
-			if (next_front == bo)
-				next_front = NULL;
+			/* the modeset blocks, the frame is on screen */
+			output->flip = *post;
+			report_flip(output, now_ns(), 0);
+			report_flip(output, now_ns(), 1);
+			output->flip.frame = 0;
+			/* the cadence restarts with the next flip */
+			output->jank.last_ns = 0;
+			output->first_post = 0;
+			output->current_front = bo;
 		}
+		pthread_mutex_unlock(&flip_lock);
 		return ret;
 	}
 
-	if (swap_interval > 1)
-		wait_for_post(1);
-	ret = page_flip(bo);
-	if (next_front) {
-		/*
-		 * wait if the driver says so or the current front
-		 * will be written by CPU
-		 */
-		page_flip(NULL);
+	if (output->latch_pending) {
+		/* the frame held back is replaced */
+		ret = latch_frame(output, layers, out_fence);
+	} else if (event_thread_running && output->flip_timeline.fd >= 0 &&
+		   (output->next_front || output->queue_len ||
+		    blocking_fence(output, layers) >= 0)) {
+		ret = queue_flip(output, layers, out_fence);
+	} else if (latch_offset_ns >= 0 && swap_interval <= 1 &&
+		   !output->next_front &&
+		   !latch_frame(output, layers, out_fence)) {
+		/* held back until its deadline */
+		ret = 0;
+	} else {
+		wait_acquire_fences(output, layers, 0);
+		ret = page_flip(output, layers, out_fence);
+		if (output->next_front && !event_thread_running) {
+			/*
+			 * wait if the driver says so or the current front
+			 * will be written by CPU
+			 */
+			page_flip(output, NULL, NULL);
+		}
 	}
 
+	pthread_mutex_unlock(&flip_lock);
+
 	return ret;
 }
 
+int hwc_context::flips_pending() const
+{
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++) {
+		if (outputs[i].next_front)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for the flips in flight on all outputs.
+ */
+void hwc_context::wait_flips()
+{
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++)
+		page_flip(&outputs[i], NULL, NULL);
+}
+
 static class hwc_context *ctx_singleton;
 
 static void on_signal(int /*sig*/)
@@ -263,12 +1387,12 @@ static void on_signal(int /*sig*/)
 	class hwc_context *ctx = ctx_singleton;
 
 	/* wait the pending flip */
-	if (ctx && ctx->next_front) {
+	if (ctx && ctx->flips_pending()) {
 		/* there is race, but this function is hacky enough to ignore that */
-		if (ctx->waiting_flip)
+		if (ctx->waiting_flip || ctx->flips_async())
 			usleep(100 * 1000); /* 100ms */
 		else
-			ctx->page_flip(NULL);
+			ctx->wait_flips();
 	}
 
 	exit(-1);
@@ -276,17 +1400,23 @@ static void on_signal(int /*sig*/)
 
 void hwc_context::init_features()
 {
-	switch (primary_output.fb_format) {
-	case HAL_PIXEL_FORMAT_RGBA_8888:
-	case HAL_PIXEL_FORMAT_RGB_565:
-		break;
-	default:
-		primary_output.fb_format = HAL_PIXEL_FORMAT_RGBA_8888;
-		break;
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++) {
+		switch (outputs[i].fb_format) {
+		case HAL_PIXEL_FORMAT_RGBA_8888:
+		case HAL_PIXEL_FORMAT_RGB_565:
+			break;
+		default:
+			outputs[i].fb_format = HAL_PIXEL_FORMAT_RGBA_8888;
+			break;
+		}
 	}
 
 	swap_interval = 1;
 
+	char value[PROPERTY_VALUE_MAX];
+	uint64_t cap = 0;
 	struct sigaction act;
 	memset(&evctx, 0, sizeof(evctx));
 	evctx.version = DRM_EVENT_CONTEXT_VERSION;
@@ -305,7 +1435,41 @@ void hwc_context::init_features()
 
 	ctx_singleton = this;
 
-	ALOGD("will use flip for fb posting");
+	use_atomic = !init_atomic();
+
+	cap = 0;
+	cursor_width = !drmGetCap(kms_fd, DRM_CAP_CURSOR_WIDTH, &cap) && cap ? cap : 64;
+	cap = 0;
+	cursor_height = !drmGetCap(kms_fd, DRM_CAP_CURSOR_HEIGHT, &cap) && cap ? cap : 64;
+
+	/* vblank timestamps are only usable on the monotonic clock */
+	property_get("debug.hwc.hw_vsync", value, "1");
+	hw_vsync = atoi(value) &&
+		!drmGetCap(kms_fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) && cap;
+
+	/* legacy flips and queued frames are fenced from the timelines */
+	for (i = 0; i < num_outputs; i++) {
+		outputs[i].ctx = this;
+		outputs[i].first_post = 1;
+		outputs[i].power_mode = KMS_POWER_ON;
+		sw_timeline_init(&outputs[i].flip_timeline);
+	}
+	init_event_thread();
+	init_late_latch();
+	init_hotplug_thread();
+	init_fb_cache();
+	memset(&atomic_stats, 0, sizeof(atomic_stats));
+	memset(&legacy_stats, 0, sizeof(legacy_stats));
+
+	ALOGD("will use %s for fb posting%s", use_atomic ? "atomic commits" : "flip",
+		event_thread_running ? ", completed by the event thread" : "");
+	if (event_thread_running)
+		ALOGD("up to %u frames queued behind a flip%s", queue_depth,
+			queue_mailbox ? ", the oldest dropped for a newer one" : "");
+	for (i = 0; i < num_outputs; i++)
+		ALOGD("display %u: crtc %d, vsync period %" PRId64 " ns, %s", i,
+			outputs[i].crtc_id, vsync_period_ns(i),
+			hw_vsync ? "vblank timestamps" : "software timer");
 }
 
 #define MARGIN_PERCENT 1.8   /* % of active vertical image*/
@@ -399,7 +1563,12 @@ static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq)
 	return (m);
 }
 
-static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp)
+/*
+ * Pick the mode of a connector.  The debug.drm.mode properties only apply
+ * to the primary display, other displays use their preferred mode.
+ */
+static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp,
+		int primary)
 {
 	char value[PROPERTY_VALUE_MAX];
 	drmModeModeInfoPtr mode;
@@ -407,7 +1576,9 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp)
 	int xres = 0, yres = 0, rate = 0;
 	int forcemode = 0;
 
-	if (property_get("debug.drm.mode", value, NULL)) {
+	if (!primary) {
+		*bpp = 0;
+	} else if (property_get("debug.drm.mode", value, NULL)) {
 		/* parse <xres>x<yres>[@<bpp>] */
 		if (sscanf(value, "%dx%d@%d", &xres, &yres, bpp) != 3) {
 			*bpp = 0;
@@ -465,9 +1636,11 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp)
 		}
 	}
 
-	/* fallback to the first mode */
-	if (!mode)
+	/* fallback to the first mode, or a made up one while disconnected */
+	if (!mode && connector->count_modes)
 		mode = &connector->modes[0];
+	else if (!mode)
+		mode = generate_mode(1024, 768, 60);
 
 	ALOGI("Established mode:");
 	ALOGI("clock: %d, hdisplay: %d, hsync_start: %d, hsync_end: %d, htotal: %d, hskew: %d", mode->clock, mode->hdisplay, mode->hsync_start, mode->hsync_end, mode->htotal, mode->hskew);
@@ -479,14 +1652,44 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp)
 	return mode;
 }
 
+/*
+ * Free a mode of find_mode() that is not one of the connector modes, once
+ * set_modes() has copied it.
+ */
+static void put_mode(drmModeConnectorPtr connector, drmModeModeInfoPtr mode)
+{
+	if (mode < connector->modes ||
+	    mode >= connector->modes + connector->count_modes)
+		free(mode);
+}
+
+/*
+ * Find the DPMS property of a connector, to blank it without atomic KMS.
+ */
+static uint32_t find_dpms_prop(int fd, drmModeConnectorPtr connector)
+{
+	uint32_t id = 0;
+	int i;
+
+	for (i = 0; i < connector->count_props && !id; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, connector->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "DPMS"))
+			id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+
+	return id;
+}
+
 /*
  * Initialize KMS with a connector.
  */
 int hwc_context::init_with_connector(struct kms_output *output,
-		drmModeConnectorPtr connector) {
+		drmModeConnectorPtr connector, int primary) {
 	drmModeEncoderPtr encoder;
 	drmModeModeInfoPtr mode;
-	static int used_crtcs = 0;
 	int bpp, i;
 
 	encoder = drmModeGetEncoder(kms_fd, connector->encoders[0]);
@@ -496,16 +1699,16 @@ int hwc_context::init_with_connector(struct kms_output *output,
 	/* find first possible crtc which is not used yet */
 	for (i = 0; i < resources->count_crtcs; i++) {
 		if (encoder->possible_crtcs & (1 << i) &&
-			(used_crtcs & (1 << i)) != (1 << i))
+			!(used_crtcs & (1 << i)))
 			break;
 	}
 
-	used_crtcs |= (1 << i);
-
 	drmModeFreeEncoder(encoder);
 	if (i == resources->count_crtcs)
 		return -EINVAL;
 
+	used_crtcs |= (1 << i);
+
 	output->crtc_id = resources->crtcs[i];
 	output->connector_id = connector->connector_id;
 	output->pipe = i;
@@ -518,10 +1721,13 @@ int hwc_context::init_with_connector(struct kms_output *output,
 	for (i = 0; i < connector->count_modes; i++)
 		ALOGI("  %s", connector->modes[i].name);
 
-	mode = find_mode(connector, &bpp);
+	mode = find_mode(connector, &bpp, primary);
 	ALOGI("the best mode is %s", mode->name);
 
-	output->mode = *mode;
+	set_modes(output, connector, mode);
+	put_mode(connector, mode);
+	output->dpms_prop = find_dpms_prop(kms_fd, connector);
+
 	switch (bpp) {
 	case 2:
 		output->fb_format = HAL_PIXEL_FORMAT_RGB_565;
@@ -532,16 +1738,120 @@ int hwc_context::init_with_connector(struct kms_output *output,
 		break;
 	}
 
-	if (connector->mmWidth && connector->mmHeight) {
-		output->xdpi = (output->mode.hdisplay * 25.4 / connector->mmWidth);
-		output->ydpi = (output->mode.vdisplay * 25.4 / connector->mmHeight);
+	return 0;
+}
+
+/*
+ * Take the modes and size of a connector, mode becoming the active one.
+ * A forced mode is not one of the connector modes, it is added last.
+ */
+void hwc_context::set_modes(struct kms_output *output,
+		drmModeConnectorPtr connector, const drmModeModeInfo *mode)
+{
+	int i;
+
+	output->mode = *mode;
+	output->num_modes = 0;
+	output->active_mode = 0;
+	for (i = 0; i < connector->count_modes &&
+			output->num_modes < KMS_MAX_MODES; i++) {
+		if (&connector->modes[i] == mode)
+			output->active_mode = output->num_modes;
+		output->modes[output->num_modes++] = connector->modes[i];
+	}
+	if (mode < connector->modes || mode >= connector->modes + i) {
+		if (output->num_modes == KMS_MAX_MODES)
+			output->num_modes--;
+		output->active_mode = output->num_modes;
+		output->modes[output->num_modes++] = *mode;
+	}
+
+	output->connected = connector->connection == DRM_MODE_CONNECTED;
+	output->mm_width = connector->mmWidth;
+	output->mm_height = connector->mmHeight;
+	set_dpi(output);
+}
+
+/*
+ * Probe the connector of an output again after a hotplug event.  A newly
+ * connected sink keeps the current mode when it supports it, otherwise it
+ * gets its preferred mode.  Returns 1 when the connection changed.
+ */
+int hwc_context::reprobe_output(uint32_t display)
+{
+	struct kms_output *output = &outputs[display];
+	drmModeConnectorPtr connector;
+	drmModeModeInfoPtr mode = NULL;
+	int was_connected = output->connected;
+	int bpp, i;
+
+	connector = drmModeGetConnector(kms_fd, output->connector_id);
+	if (!connector)
+		return 0;
+
+	if (connector->connection == DRM_MODE_CONNECTED && !was_connected) {
+		for (i = 0; i < connector->count_modes; i++) {
+			if (!memcmp(&connector->modes[i], &output->mode,
+					sizeof(output->mode))) {
+				mode = &connector->modes[i];
+				break;
+			}
+		}
+		if (!mode)
+			mode = find_mode(connector, &bpp, display == 0);
+
+		pthread_mutex_lock(&flip_lock);
+		set_modes(output, connector, mode);
+		put_mode(connector, mode);
+		/* the mode blob is made again on the next modeset */
+		if (use_atomic && output->mode_blob_id) {
+			drmModeDestroyPropertyBlob(kms_fd, output->mode_blob_id);
+			output->mode_blob_id = 0;
+			drmModeCreatePropertyBlob(kms_fd, &output->mode,
+					sizeof(output->mode), &output->mode_blob_id);
+		}
+		pthread_mutex_unlock(&flip_lock);
+	} else if (connector->connection != DRM_MODE_CONNECTED && was_connected) {
+		disable_output(output);
+	}
+	drmModeFreeConnector(connector);
+
+	return output->connected != was_connected;
+}
+
+/*
+ * Turn off the crtc of an output whose sink went away.  Frames posted to
+ * it are dropped until it comes back, and the next post sets the mode.
+ */
+void hwc_context::disable_output(struct kms_output *output)
+{
+	pthread_mutex_lock(&flip_lock);
+
+	drain_flips(output);
+
+	output->connected = 0;
+	output->first_post = 1;
+	output->current_front = NULL;
+	if (drmModeSetCrtc(kms_fd, output->crtc_id, 0, 0, 0, NULL, 0, NULL))
+		ALOGW("failed to turn off crtc %d (%s)", output->crtc_id,
+			strerror(errno));
+
+	pthread_mutex_unlock(&flip_lock);
+}
+
+/*
+ * Derive the density of an output from its current mode.
+ */
+void hwc_context::set_dpi(struct kms_output *output)
+{
+	if (output->mm_width && output->mm_height) {
+		output->xdpi = (output->mode.hdisplay * 25.4 / output->mm_width);
+		output->ydpi = (output->mode.vdisplay * 25.4 / output->mm_height);
 	}
 	else {
 		output->xdpi = 75;
 		output->ydpi = 75;
 	}
-
-	return 0;
 }
 
 
@@ -569,11 +1879,64 @@ drmModeConnectorPtr hwc_context::fetch_connector(uint32_t type)
 	return NULL;
 }
 
+/*
+ * Add the other connectors as secondary displays, each on a crtc of its
+ * own.  Connected ones go first so that they get a crtc when there are
+ * too few for all.  A disconnected one keeps its crtc until a sink shows
+ * up, then reprobe_output() brings it up.
+ */
+int hwc_context::add_secondary_outputs()
+{
+	char value[PROPERTY_VALUE_MAX];
+	uint32_t max_outputs;
+	uint32_t j;
+	int i, pass;
+
+	property_get("debug.hwc.max_displays", value, "0");
+	max_outputs = atoi(value);
+	if (!max_outputs || max_outputs > KMS_MAX_OUTPUTS)
+		max_outputs = KMS_MAX_OUTPUTS;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < resources->count_connectors &&
+				num_outputs < max_outputs; i++) {
+			drmModeConnectorPtr connector;
+			int connected, used = 0;
+
+			connector = drmModeGetConnector(kms_fd,
+					resources->connectors[i]);
+			if (!connector)
+				continue;
+
+			for (j = 0; j < num_outputs; j++) {
+				if (outputs[j].connector_id == connector->connector_id)
+					used = 1;
+			}
+			connected = connector->connection == DRM_MODE_CONNECTED;
+			if (!used && connected == !pass &&
+			    connector->count_encoders &&
+			    (!connected || connector->count_modes) &&
+			    !init_with_connector(&outputs[num_outputs],
+					connector, 0)) {
+				if (!connected)
+					ALOGI("display %u waits for a sink on connector %u",
+						num_outputs, connector->connector_id);
+				outputs[num_outputs].active = 1;
+				num_outputs++;
+			}
+			drmModeFreeConnector(connector);
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Initialize KMS.
  */
 int hwc_context::init_kms()
 {
+	struct kms_output *output = &outputs[0];
 	drmModeConnectorPtr primary;
 	int i;
 
@@ -586,14 +1949,14 @@ int hwc_context::init_kms()
 	/* find the crtc/connector/mode to use */
 	primary = fetch_connector(DRM_MODE_CONNECTOR_HDMIA);
 	if (primary) {
-		init_with_connector(&primary_output, primary);
+		init_with_connector(output, primary, 1);
 		drmModeFreeConnector(primary);
-		primary_output.active = 1;
+		output->active = 1;
 	}
 
 	/* if still no connector, find first connected connector and try it */
 	int lastValidConnectorIndex = -1;
-	if (!primary_output.active) {
+	if (!output->active) {
 
 		for (i = 0; i < resources->count_connectors; i++) {
 			drmModeConnectorPtr connector;
@@ -604,7 +1967,7 @@ int hwc_context::init_kms()
 				lastValidConnectorIndex = i;
 				if (connector->connection == DRM_MODE_CONNECTED) {
 					if (!init_with_connector(
-							&primary_output, connector))
+							output, connector, 1))
 						break;
 				}
 
@@ -617,7 +1980,7 @@ int hwc_context::init_kms()
 			if (lastValidConnectorIndex > -1) {
 				ALOGD("no connected connector found, enforcing the use of valid connector %d", lastValidConnectorIndex);
 				drmModeConnectorPtr connector = drmModeGetConnector(kms_fd, resources->connectors[lastValidConnectorIndex]);
-				init_with_connector(&primary_output, connector);
+				init_with_connector(output, connector, 1);
 				drmModeFreeConnector(connector);
 			}
 			else {
@@ -629,9 +1992,11 @@ int hwc_context::init_kms()
 			}
 		}
 	}
+	num_outputs = 1;
+
+	add_secondary_outputs();
 
 	init_features();
-	first_post = 1;
 	return 0;
 }
 
@@ -653,7 +2018,32 @@ int hwc_context::hwc_init(struct drm_module_t *mod) {
 
 
 hwc_context::hwc_context() {
-    fps = 60.0;
+    use_atomic = 0;
+    hw_vsync = 0;
+    cursor_width = cursor_height = 64;
+    post_seq = 0;
+    memset(outputs, 0, sizeof(outputs));
+    for (uint32_t i = 0; i < KMS_MAX_OUTPUTS; i++) {
+        outputs[i].flip_timeline.fd = -1;
+        outputs[i].watched_fence = -1;
+    }
+    num_outputs = 0;
+    used_crtcs = 0;
+    resources = NULL;
+    pthread_mutex_init(&flip_lock, NULL);
+    pthread_cond_init(&flip_cond, NULL);
+    event_thread_running = 0;
+    epoll_fd = -1;
+    queue_depth = 1;
+    queue_mailbox = 0;
+    latch_offset_ns = -1;
+    latch_timer = -1;
+    waiting_flip = 0;
+    pthread_mutex_init(&hotplug_lock, NULL);
+    hotplug_proc = NULL;
+    hotplug_data = NULL;
+    flip_proc = NULL;
+    flip_data = NULL;
     int error = hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
            (const hw_module_t **)&mModule);
     if (error) {
@@ -662,28 +2052,205 @@ hwc_context::hwc_context() {
         error = hwc_init(mModule);
         if (error != 0) {
             ALOGE("failed hwc_init_kms() %d", error);
-        } else {
-            width = (uint32_t)primary_output.mode.hdisplay;
-            height = (uint32_t)primary_output.mode.vdisplay;
-            fps = (float)primary_output.mode.vrefresh;
-            format = primary_output.fb_format;
-            xdpi = (float)primary_output.xdpi;
-            ydpi = (float)primary_output.ydpi;
+            num_outputs = 0;
         }
     }
 }
 
+const struct kms_output *hwc_context::get_output(uint32_t display) const
+{
+	return display < num_outputs ? &outputs[display] : NULL;
+}
+
+
+/*
+ * Resolve the bos of a frame and lay them out by plane.  The client
+ * target, if any, covers the whole primary plane.
+ */
+int hwc_context::stage_layers(struct kms_output *output, buffer_handle_t target,
+		int target_fence, const struct kms_layer *layers,
+		uint32_t count, struct kms_layer *staged)
+{
+	struct gralloc_drm_bo_t *bo;
+	uint32_t i;
+	int err;
+
+	memset(staged, 0, sizeof(*staged) * KMS_MAX_PLANES);
+	for (i = 0; i < KMS_MAX_PLANES; i++)
+		staged[i].acquire_fence = -1;
+
+	for (i = 0; i < count; i++) {
+		if (layers[i].plane >= output->num_planes)
+			return -EINVAL;
+		bo = gralloc_drm_bo_from_handle(layers[i].handle);
+		if (!bo)
+			return -EINVAL;
+		staged[layers[i].plane] = layers[i];
+		staged[layers[i].plane].bo = bo;
+	}
+
+	if (target) {
+		bo = gralloc_drm_bo_from_handle(target);
+		if (!bo)
+			return -EINVAL;
+		staged[0].handle = target;
+		staged[0].bo = bo;
+		staged[0].acquire_fence = target_fence;
+		staged[0].plane = 0;
+		staged[0].src_x = 0;
+		staged[0].src_y = 0;
+		staged[0].src_w = (uint32_t) bo->handle->width << 16;
+		staged[0].src_h = (uint32_t) bo->handle->height << 16;
+		staged[0].crtc_x = 0;
+		staged[0].crtc_y = 0;
+		staged[0].crtc_w = output->mode.hdisplay;
+		staged[0].crtc_h = output->mode.vdisplay;
+		staged[0].rotation = DRM_MODE_ROTATE_0;
+	}
+
+	if (!staged[0].bo)
+		return -EINVAL;
+
+	for (i = 0; i < KMS_MAX_PLANES; i++) {
+		bo = staged[i].bo;
+		if (!bo)
+			continue;
+		err = get_fb(output, bo);
+		if (err) {
+			ALOGE("unable to post bo %p without fb", bo);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Post a frame.  target_damage, when given, is the region of the client
+ * target changed since the previous one.  out_present_fence receives a
+ * fence signalled when the frame is on screen, or -1 when it already is.
+ * frame numbers the post for the flip callback, 0 leaves it unreported.
+ * The acquire fences of the target and the layers are taken over; they
+ * go to the kernel with the commit when it takes them, and are waited for
+ * right before the commit otherwise.
+ */
+int hwc_context::hwc_post(uint32_t display, uint64_t frame,
+		buffer_handle_t target, int target_fence,
+		const struct kms_damage *target_damage,
+		const struct kms_layer *layers, uint32_t count,
+		int *out_present_fence)
+{
+	struct kms_layer staged[KMS_MAX_PLANES];
+	struct kms_output *output;
+	struct kms_post post;
+	uint32_t i;
+	int err;
+
+	post.present_ns = now_ns();
+	*out_present_fence = -1;
+	if (display >= num_outputs) {
+		err = -ENODEV;
+		goto drop;
+	}
+	output = &outputs[display];
+	/* nothing to show the frame on, its buffers are released at once */
+	if (!output->connected || output->power_mode == KMS_POWER_OFF) {
+		err = 0;
+		goto drop;
+	}
+	post_seq++;
+	output->post_seq++;
+
+	err = stage_layers(output, target, target_fence, layers, count, staged);
+	if (err)
+		goto drop;
+	if (target && target_damage)
+		staged[0].damage = *target_damage;
+
+	post.frame = frame;
+	post.fence_pending = fences_pending(staged);
+
+	ATRACE_BEGIN("bo_post");
+	err = bo_post(output, &post, staged, out_present_fence);
+	ATRACE_END();
+	return err;
+
+drop:
+	for (i = 0; i < count; i++) {
+		if (layers[i].acquire_fence >= 0)
+			close(layers[i].acquire_fence);
+	}
+	if (target_fence >= 0)
+		close(target_fence);
+	return err;
+}
+
+/*
+ * Ask the kernel whether a frame could be committed as is.
+ */
+int hwc_context::hwc_check(uint32_t display, buffer_handle_t target,
+		const struct kms_layer *layers, uint32_t count)
+{
+	struct kms_layer staged[KMS_MAX_PLANES];
+	struct kms_output *output;
+	int err;
+
+	if (display >= num_outputs)
+		return -ENODEV;
+	output = &outputs[display];
+
+	/* without a modeset the crtc state is not known yet */
+	if (!use_atomic || output->first_post ||
+	    output->power_mode == KMS_POWER_OFF)
+		return -EAGAIN;
 
-int hwc_context::hwc_post(buffer_handle_t handle)
+	err = stage_layers(output, target, -1, layers, count, staged);
+	if (err)
+		return err;
+
+	return atomic_commit(output, staged, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+}
+
+uint32_t hwc_context::buffer_format(buffer_handle_t handle)
 {
 	struct gralloc_drm_bo_t *bo;
 
 	bo = gralloc_drm_bo_from_handle(handle);
 	if (!bo)
-		return -EINVAL;
+		return 0;
 
-	return bo_post(bo);
+	return drm_format_from_hal(bo->handle->format);
 }
 
-} // namespace anroid
+bool hwc_context::present_fence_reliable() const
+{
+	uint32_t i;
+
+	for (i = 0; i < num_outputs; i++) {
+		if (use_atomic && outputs[i].crtc_prop.out_fence_ptr)
+			continue;
+		if (outputs[i].flip_timeline.fd < 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Planes available for layers of a display, the cursor plane included.
+ * The legacy path only knows about the primary plane through the crtc, so
+ * nothing is offered there.
+ */
+const struct kms_plane *hwc_context::get_planes(uint32_t display,
+		uint32_t *count) const
+{
+	if (display >= num_outputs) {
+		*count = 0;
+		return NULL;
+	}
+
+	*count = use_atomic ? outputs[display].num_planes : 0;
+	return outputs[display].planes;
+}
 
+} // namespace anroid
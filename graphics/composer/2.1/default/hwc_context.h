@@ -1,12 +1,137 @@
 #ifndef _HWC_CONTEXT_H_
 #define _HWC_CONTEXT_H_
 
+#include <pthread.h>
 #include <xf86drmMode.h>
 #include <gralloc_drm.h>
 #include <gralloc_drm_priv.h>
 
+#include "sw_timeline.h"
+
 namespace android {
 
+#define KMS_MAX_OUTPUTS 4
+#define KMS_MAX_PLANES 8
+#define KMS_MAX_FORMATS 32
+#define KMS_MAX_MODES 32
+#define KMS_MAX_QUEUED_FLIPS 3
+#define KMS_MAX_DAMAGE_RECTS 8
+#define KMS_FB_CACHE_SIZE 32
+/* fbs used by this many last posts of an output may be queued or on screen */
+#define KMS_FB_PINNED_POSTS (KMS_MAX_QUEUED_FLIPS + 2)
+
+struct kms_plane
+{
+	uint32_t plane_id;
+	uint32_t type;
+	uint32_t formats[KMS_MAX_FORMATS];
+	uint32_t num_formats;
+	uint64_t rotations;
+
+	/* property ids, 0 when the plane does not expose it */
+	struct {
+		uint32_t fb_id;
+		uint32_t crtc_id;
+		uint32_t src_x, src_y, src_w, src_h;
+		uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+		uint32_t rotation;
+		uint32_t fb_damage_clips;
+		uint32_t in_fence_fd;
+	} prop;
+};
+
+/* same layout as struct drm_mode_rect, the FB_DAMAGE_CLIPS blob format */
+struct kms_rect
+{
+	int32_t x1, y1, x2, y2;
+};
+
+/*
+ * Region of a fb changed since the previous frame on its plane, in fb
+ * pixels.  No rects means the whole fb.
+ */
+struct kms_damage
+{
+	uint32_t count;
+	struct kms_rect rects[KMS_MAX_DAMAGE_RECTS];
+};
+
+/*
+ * A buffer scanned out by a plane.  Source is in 16.16 fixed point,
+ * destination in pixels.  acquire_fence, -1 for none, signals when the
+ * buffer is ready; the frame owns it until the frame is committed or
+ * dropped.
+ */
+struct kms_layer
+{
+	buffer_handle_t handle;
+	struct gralloc_drm_bo_t *bo;
+	uint32_t plane;
+	uint32_t src_x, src_y, src_w, src_h;
+	int32_t crtc_x, crtc_y;
+	uint32_t crtc_w, crtc_h;
+	uint64_t rotation;
+	struct kms_damage damage;
+	int acquire_fence;
+};
+
+/*
+ * A call to hwc_post, followed from the submission to the flip.  frame
+ * numbers it for the flip callback, 0 leaves it unreported.  present_ns is
+ * when hwc_post was called, fence_pending whether an acquire fence of the
+ * frame had not signalled by then.
+ */
+struct kms_post
+{
+	uint64_t frame;
+	int64_t present_ns;
+	int fence_pending;
+};
+
+/*
+ * A frame waiting for the flip in flight to complete, or for its late
+ * latch.  timeline_fence counts the fences of flip_timeline signalled
+ * when the frame is on screen, those of the frames it replaced included.
+ */
+struct kms_frame
+{
+	struct kms_layer layers[KMS_MAX_PLANES];
+	int timeline_fence;
+	struct kms_post post;
+};
+
+/*
+ * Frames of an output that reached the screen after the vblank the flip
+ * cadence expected them on, the previous frame being shown again
+ * meanwhile.  Late frames are counted by reason, flips the kernel refused
+ * as busy leave the previous frame on screen as well.
+ */
+struct kms_jank
+{
+	uint64_t flips;
+	uint64_t late;
+	/* vblanks the previous frames were repeated for */
+	uint64_t repeated;
+	uint64_t late_fence;
+	uint64_t late_present;
+	uint64_t late_commit;
+	uint64_t flip_busy;
+
+	/* vblank of the last flip, last_ns is 0 until a flip after a modeset */
+	unsigned int last_seq;
+	int64_t last_ns;
+};
+
+/* power modes of an output */
+enum kms_power_mode
+{
+	KMS_POWER_OFF,
+	KMS_POWER_DOZE,
+	KMS_POWER_ON,
+};
+
+class hwc_context;
+
 struct kms_output
 {
 	uint32_t crtc_id;
@@ -14,22 +139,145 @@ struct kms_output
 	uint32_t pipe;
 	drmModeModeInfo mode;
 	int xdpi, ydpi;
+
+	/* connector modes, the display configs, mode is modes[active_mode] */
+	drmModeModeInfo modes[KMS_MAX_MODES];
+	uint32_t num_modes;
+	uint32_t active_mode;
+	uint32_t mm_width, mm_height;
+
 	int fb_format;
 	int bpp;
 	uint32_t active;
+	/* a sink is attached, frames are dropped otherwise */
+	int connected;
+	/* enum kms_power_mode, frames are dropped while off */
+	int power_mode;
+	/* legacy DPMS property of the connector, 0 when there is none */
+	uint32_t dpms_prop;
+
+	/* atomic state, planes[0] is the primary plane */
+	struct kms_plane planes[KMS_MAX_PLANES];
+	uint32_t num_planes;
+	/* index of the cursor plane in planes, 0 when there is none */
+	uint32_t cursor_plane;
+	uint32_t mode_blob_id;
+	struct {
+		uint32_t active;
+		uint32_t mode_id;
+		uint32_t out_fence_ptr;
+		uint32_t ctm;
+		uint32_t gamma_lut;
+	} crtc_prop;
+	uint32_t gamma_lut_size;
+
+	/* colour transform blobs, committed with the next frame when dirty */
+	uint32_t ctm_blob_id, gamma_blob_id;
+	int color_dirty;
+	struct {
+		uint32_t crtc_id;
+	} conn_prop;
+
+	/* flip state, protected by flip_lock */
+	class hwc_context *ctx;
+	int first_post;
+	unsigned int last_swap;
+	struct gralloc_drm_bo_t *current_front, *next_front;
+	struct kms_frame flip_queue[KMS_MAX_QUEUED_FLIPS];
+	uint32_t queue_head, queue_len;
+	/* posts to the output, see struct kms_fb */
+	uint64_t post_seq;
+	/* queued frames dropped for newer ones, see queue_mailbox */
+	uint64_t queue_dropped;
+	/*
+	 * acquire fence the oldest queued or the latched frame waits for,
+	 * watched by the event thread, -1 for none
+	 */
+	int watched_fence;
+	/* fences of flip_timeline signalled by the flip in flight */
+	int flip_on_timeline;
+	/* the post being submitted and the flip in flight */
+	struct kms_post post, flip;
+	struct kms_jank jank;
+
+	/* frame held back by the late latch until latch_ns */
+	struct kms_frame latched;
+	int latch_pending;
+	int64_t latch_ns;
+	/* frames held back, and those of them a newer frame replaced */
+	uint64_t latch_count, latch_replaced;
+
+	/* signalled by page_flip_handler when the kernel gives no out fence */
+	struct sw_timeline flip_timeline;
+};
+
+/*
+ * A cached fb.  last_used orders the cache by post_seq of the context,
+ * output_seq holds the post_seq of each output at the last post using
+ * the fb there, 0 when none did.  The fb may be queued or on screen while
+ * it is used by one of the last KMS_FB_PINNED_POSTS posts of an output.
+ */
+struct kms_fb
+{
+	struct gralloc_drm_bo_t *bo;
+	uint64_t last_used;
+	uint64_t output_seq[KMS_MAX_OUTPUTS];
+};
+
+struct fb_cache_stats
+{
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
 };
 
+struct commit_stats
+{
+	uint64_t count;
+	int64_t total_ns;
+	int64_t max_ns;
+};
+
+/* called from the hotplug thread when a sink comes or goes */
+typedef void (*kms_hotplug_proc_t)(void *data, uint32_t display, int connected);
+/*
+ * called with flip_lock held when a frame was submitted to the kernel,
+ * and when it reached the screen with the kernel timestamp of the flip
+ */
+typedef void (*kms_flip_proc_t)(void *data, uint32_t display, uint64_t frame,
+		int64_t timestamp, int done);
+
+unsigned int drm_format_from_hal(int hal_format);
+int64_t drm_mode_period_ns(const drmModeModeInfo *mode);
+
 class hwc_context {
   public :
     hwc_context();
-    int hwc_post(buffer_handle_t handle);
-
-    uint32_t  width;
-    uint32_t  height;
-    int       format;
-    float     fps;
-    float     xdpi;
-    float     ydpi;
+    uint32_t num_displays() const { return num_outputs; }
+    const struct kms_output *get_output(uint32_t display) const;
+    int hwc_post(uint32_t display, uint64_t frame,
+    		buffer_handle_t target, int target_fence,
+    		const struct kms_damage *target_damage,
+    		const struct kms_layer *layers, uint32_t count,
+    		int *out_present_fence);
+    int hwc_check(uint32_t display, buffer_handle_t target,
+    		const struct kms_layer *layers, uint32_t count);
+    uint32_t buffer_format(buffer_handle_t handle);
+    const struct kms_plane *get_planes(uint32_t display, uint32_t *count) const;
+    int prepare_fb(buffer_handle_t handle);
+    int64_t vsync_period_ns(uint32_t display) const;
+    int set_mode(uint32_t display, uint32_t mode);
+    int set_power_mode(uint32_t display, int mode);
+    int is_connected(uint32_t display) const;
+    int move_cursor(uint32_t display, int32_t x, int32_t y);
+    void cursor_size(uint32_t *width, uint32_t *height) const;
+    int set_color_transform(uint32_t display, const float *matrix);
+    bool color_transform_supported() const;
+    void set_hotplug_callback(kms_hotplug_proc_t proc, void *data);
+    void set_flip_callback(kms_flip_proc_t proc, void *data);
+    int wait_vblank(uint32_t display, int64_t *timestamp);
 
   private:
     struct drm_module_t *mModule;
@@ -38,27 +286,153 @@ class hwc_context {
     int init_kms();
     drmModeConnectorPtr fetch_connector(uint32_t type);
     int init_with_connector(struct kms_output *output,
-    		drmModeConnectorPtr connector);
+    		drmModeConnectorPtr connector, int primary);
+    int add_secondary_outputs();
     void init_features();
-    int bo_post(struct gralloc_drm_bo_t *bo);
-    void wait_for_post(int flip);
+    int stage_layers(struct kms_output *output, buffer_handle_t target,
+    		int target_fence, const struct kms_layer *layers,
+    		uint32_t count, struct kms_layer *staged);
+    void wait_acquire_fences(struct kms_output *output,
+    		struct kms_layer *layers, int all);
+    int bo_post(struct kms_output *output, const struct kms_post *post,
+    		struct kms_layer *layers, int *out_fence);
+    void wait_for_post(struct kms_output *output, int flip);
+    unsigned int vblank_type(const struct kms_output *output,
+    		unsigned int type) const;
     int set_crtc(struct kms_output *output, int fb_id);
+    void set_dpi(struct kms_output *output);
+    void set_modes(struct kms_output *output, drmModeConnectorPtr connector,
+    		const drmModeModeInfo *mode);
+    int switch_mode(struct kms_output *output, const drmModeModeInfo *mode);
+    int set_active(struct kms_output *output, int active);
+    int reprobe_output(uint32_t display);
+    void disable_output(struct kms_output *output);
+
+    /* drm_hotplug_rpi3.cpp */
+    int init_hotplug_thread();
+    void handle_hotplug(uint32_t connector_id);
+
+    /* drm_fb_rpi3.cpp */
+    void init_fb_cache();
+    uint32_t fb_pinned_posts() const;
+    int fb_pinned(const struct kms_fb *fb) const;
+    int evict_fb();
+    void extend_fb_pins(const struct kms_output *output);
+    int get_fb(const struct kms_output *output, struct gralloc_drm_bo_t *bo);
+
+    /* drm_atomic_rpi3.cpp */
+    int init_atomic();
+    int init_output_atomic(struct kms_output *output);
+    int atomic_modeset(struct kms_output *output,
+    		const struct kms_layer *layers);
+    int atomic_set_mode(struct kms_output *output,
+    		const drmModeModeInfo *mode);
+    int atomic_set_active(struct kms_output *output, int active);
+    int atomic_test_color(struct kms_output *output, uint32_t ctm_blob_id,
+    		uint32_t gamma_blob_id);
+    int atomic_commit(struct kms_output *output,
+    		const struct kms_layer *layers, uint32_t flags, int *out_fence);
 
   private:
 	int kms_fd;
+	int hw_vsync;
+	uint32_t cursor_width, cursor_height;
 	drmModeResPtr resources;
-	struct kms_output primary_output;
+
+	/* outputs[0] is the primary display */
+	struct kms_output outputs[KMS_MAX_OUTPUTS];
+	uint32_t num_outputs;
+	uint32_t used_crtcs;
 
 	int swap_interval;
 	drmEventContext evctx;
-	int first_post;
-	unsigned int last_swap;
+	int use_atomic;
+
+	/*
+	 * Flips are completed by the event thread.  flip_lock protects the
+	 * flip state of every output.
+	 */
+	pthread_mutex_t flip_lock;
+	pthread_cond_t flip_cond;
+	pthread_t event_thread;
+	int event_thread_running;
+	int epoll_fd;
+	/*
+	 * Frames queued behind the flip in flight, at most.  A post finding
+	 * the queue full waits for a slot, or with queue_mailbox drops the
+	 * oldest queued frame.
+	 */
+	uint32_t queue_depth;
+	int queue_mailbox;
+
+	/*
+	 * Late latch: with latch_offset_ns set, a frame posted while no flip
+	 * is in flight is committed latch_offset_ns plus the commit cost
+	 * before the next vblank, by the event thread woken by latch_timer.
+	 */
+	int64_t latch_offset_ns;
+	int latch_timer;
+
+	/* fbs of recently posted bos, post_seq counts hwc_post calls */
+	struct kms_fb fb_cache[KMS_FB_CACHE_SIZE];
+	uint64_t post_seq;
+
+	int init_event_thread();
+	void wait_flip(struct kms_output *output);
+	int page_flip(struct kms_output *output,
+			const struct kms_layer *layers, int *out_fence);
+	int queue_flip(struct kms_output *output,
+			struct kms_layer *layers, int *out_fence);
+	void submit_queued_flip(struct kms_output *output);
+	int drop_queued_flip(struct kms_output *output);
+	void submit_frame(struct kms_output *output, struct kms_frame *frame);
+	int kernel_waits_fence(const struct kms_output *output,
+			uint32_t plane) const;
+	int blocking_fence(const struct kms_output *output,
+			const struct kms_layer *layers) const;
+	int watch_fence(struct kms_output *output, struct kms_layer *layers);
+	void unwatch_fence(struct kms_output *output);
+	void submit_waiting_flip(struct kms_output *output);
+	void on_fence_signaled(int fd);
+	void drain_flips(struct kms_output *output);
+	void init_late_latch();
+	int64_t commit_cost() const;
+	int latch_frame(struct kms_output *output,
+			const struct kms_layer *layers, int *out_fence);
+	void arm_latch_timer();
+	void submit_latched(struct kms_output *output);
+	void submit_latched_frames();
+
+	kms_flip_proc_t flip_proc;
+	void *flip_data;
+	void report_flip(struct kms_output *output, int64_t timestamp, int done);
+	void check_jank(struct kms_output *output, unsigned int sequence,
+			int64_t timestamp);
+
+	/* hotplug_lock protects the callback */
+	pthread_mutex_t hotplug_lock;
+	pthread_t hotplug_thread;
+	kms_hotplug_proc_t hotplug_proc;
+	void *hotplug_data;
 
   public:
-    int page_flip(struct gralloc_drm_bo_t *bo);
+    void on_flip_complete(struct kms_output *output, unsigned int sequence,
+    		int64_t timestamp);
+    void hotplug_loop();
+    void event_loop();
+    bool flips_async() const { return event_thread_running; }
+    int flips_pending() const;
+    void wait_flips();
     int waiting_flip;
-    struct gralloc_drm_bo_t *current_front, *next_front;
 
+    bool present_fence_reliable() const;
+
+    /* time spent submitting a flip, per commit path */
+    struct commit_stats atomic_stats;
+    struct commit_stats legacy_stats;
+    bool atomic_enabled() const { return use_atomic; }
+
+    struct fb_cache_stats fb_stats;
 };
 
 } // namespace anroid
@@ -0,0 +1,105 @@
+#define LOG_TAG "composer@2.1-sw_timeline"
+//#define LOG_NDEBUG 0
+
+#include <utils/Log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "sw_timeline.h"
+
+namespace android {
+
+/* uapi of drivers/dma-buf/sw_sync.c, not exported by the kernel headers */
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+
+#define SW_SYNC_IOC_MAGIC		'W'
+#define SW_SYNC_IOC_CREATE_FENCE	_IOWR(SW_SYNC_IOC_MAGIC, 0, \
+		struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC			_IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
+
+int sw_timeline_init(struct sw_timeline *tl)
+{
+	tl->created = 0;
+	tl->signaled = 0;
+
+	tl->fd = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+	if (tl->fd < 0)
+		tl->fd = open("/dev/sw_sync", O_RDWR | O_CLOEXEC);
+	if (tl->fd < 0) {
+		ALOGW("sw_sync is not available (%s)", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+void sw_timeline_fini(struct sw_timeline *tl)
+{
+	if (tl->fd < 0)
+		return;
+
+	sw_timeline_signal_all(tl);
+	close(tl->fd);
+	tl->fd = -1;
+}
+
+/*
+ * Create a fence signalled by the next event not yet fenced.
+ */
+int sw_timeline_fence(struct sw_timeline *tl, const char *name)
+{
+	struct sw_sync_create_fence_data data;
+
+	if (tl->fd < 0)
+		return -1;
+
+	memset(&data, 0, sizeof(data));
+	data.value = tl->created + 1;
+	strncpy(data.name, name, sizeof(data.name) - 1);
+
+	if (ioctl(tl->fd, SW_SYNC_IOC_CREATE_FENCE, &data)) {
+		ALOGE("failed to create fence %u (%s)", data.value, strerror(errno));
+		return -1;
+	}
+	tl->created++;
+
+	return data.fence;
+}
+
+void sw_timeline_signal(struct sw_timeline *tl)
+{
+	uint32_t inc = 1;
+
+	if (tl->fd < 0 || tl->signaled == tl->created)
+		return;
+
+	if (ioctl(tl->fd, SW_SYNC_IOC_INC, &inc))
+		ALOGE("failed to advance timeline (%s)", strerror(errno));
+	else
+		tl->signaled++;
+}
+
+/*
+ * Release every waiter, used when events were lost.
+ */
+void sw_timeline_signal_all(struct sw_timeline *tl)
+{
+	uint32_t inc = tl->created - tl->signaled;
+
+	if (tl->fd < 0 || !inc)
+		return;
+
+	if (ioctl(tl->fd, SW_SYNC_IOC_INC, &inc))
+		ALOGE("failed to advance timeline (%s)", strerror(errno));
+	else
+		tl->signaled = tl->created;
+}
+
+} // namespace android
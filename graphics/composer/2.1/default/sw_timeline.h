@@ -0,0 +1,28 @@
+#ifndef _SW_TIMELINE_H_
+#define _SW_TIMELINE_H_
+
+#include <stdint.h>
+
+namespace android {
+
+/*
+ * A sw_sync timeline handing out fences for events the kernel does not
+ * fence itself, like legacy page flips.  Fences are created in submission
+ * order and signalled one by one as the events complete.
+ */
+struct sw_timeline
+{
+	int fd;
+	uint32_t created;
+	uint32_t signaled;
+};
+
+int sw_timeline_init(struct sw_timeline *tl);
+void sw_timeline_fini(struct sw_timeline *tl);
+int sw_timeline_fence(struct sw_timeline *tl, const char *name);
+void sw_timeline_signal(struct sw_timeline *tl);
+void sw_timeline_signal_all(struct sw_timeline *tl);
+
+} // namespace android
+
+#endif // _SW_TIMELINE_H_